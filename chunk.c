@@ -17,9 +17,11 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
     // なかったら配列を拡大する
     if (chunk->capacity < chunk->count + 1) {
         int old_capacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(old_capacity);
+        ensure_heap_room((sizeof(uint8_t) + sizeof(int)) * (size_t)(capacity - old_capacity));
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, capacity);
+        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, capacity);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
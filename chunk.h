@@ -36,7 +36,7 @@ typedef enum {
     OP_DEFINE_GLOBAL,
     // グローバル変数に代入する
     OP_SET_GLOBAL,
-    // スーパークラスを取得する
+    // スーパークラスのメソッドを取得する（オペランドは2バイトのセレクタ番号）
     OP_GET_SUPER,
     // ==
     OP_EQUAL,
@@ -66,9 +66,9 @@ typedef enum {
     OP_LOOP,
     // コール
     OP_CALL,
-    // インスタンスのプロパティを取得してコールする
+    // インスタンスのプロパティを取得してコールする（オペランドは2バイトのセレクタ番号と引数の個数）
     OP_INVOKE,
-    // スーパークラスのメソッドを取得してコールする
+    // スーパークラスのメソッドを取得してコールする（オペランドはOP_INVOKEと同じ）
     OP_SUPER_INVOKE,
     // クロージャを作成する
     OP_CLOSURE,
@@ -80,8 +80,20 @@ typedef enum {
     OP_CLASS,
     // クラスを継承する
     OP_INHERIT,
-    // メソッドを生成する
+    // メソッドを生成する（オペランドは2バイトのセレクタ番号）
     OP_METHOD,
+    // スタックの上の値を並べたリストを作る（オペランドは要素の個数）
+    OP_BUILD_LIST,
+    // リストの要素を取得する
+    OP_GET_INDEX,
+    // リストの要素に代入する
+    OP_SET_INDEX,
+    // スタックの上のキーと値の組を並べたマップを作る（オペランドは組の個数）
+    OP_BUILD_MAP,
+    // for-inで列挙する値を用意する．マップはキーのリストに置き換える
+    OP_FOR_IN_BEGIN,
+    // for-inの次の要素をループ変数に入れる．なければループを抜ける（オペランドは列挙する値のスロットと2バイトのジャンプ先）
+    OP_FOR_IN_NEXT,
 } OpCode;
 
 /// @brief 動的配列
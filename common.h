@@ -6,6 +6,10 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+#define POOL_ALLOCATOR
+// #define STRING_HASH_FNV
+// #define TABLE_NO_SIMD
+// #define FLOAT_KERNELS_NO_SIMD
 #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
@@ -234,6 +234,15 @@ static int emit_jump(uint8_t instruction) {
     return current_chunk()->count - 2;
 }
 
+/// @brief セレクタ番号をオペランドに持つ命令をチャンクに加える
+/// @param instruction 命令
+/// @param selector セレクタ番号（2バイト）
+static void emit_selector(uint8_t instruction, uint16_t selector) {
+    emit_byte(instruction);
+    emit_byte((selector >> 8) & 0xff);
+    emit_byte(selector & 0xff);
+}
+
 /// @brief OP_RETURNをチャンクに加える
 static void emit_return() {
     if (current->type == TYPE_INITIALIZER) {
@@ -299,6 +308,19 @@ static uint8_t identifier_constant(Token* name) {
     return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
+/// @brief トークンの字句をメソッド名のセレクタとして登録する
+/// @param name セレクタとして登録する字句
+/// @return セレクタ番号
+static uint16_t identifier_selector(Token* name) {
+    int selector = intern_selector(copy_string(name->start, name->length));
+    if (selector > UINT16_MAX) {
+        error("Too many method names.");
+        return 0;
+    }
+
+    return (uint16_t)selector;
+}
+
 /// @brief 識別子が同じであるかどうかを確かめる
 /// @param a 
 /// @param b 
@@ -503,20 +525,74 @@ static void call(bool can_assign) {
 /// @param can_assign 
 static void dot(bool can_assign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(&parser.previous);
+    Token property = parser.previous;
+    uint8_t name = identifier_constant(&property);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
         emit_bytes(OP_SET_PROPERTY, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
+        uint16_t selector = identifier_selector(&property);
         uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
+        emit_selector(OP_INVOKE, selector);
         emit_byte(arg_count);
     } else {
         emit_bytes(OP_GET_PROPERTY, name);
     }
 }
 
+/// @brief 添字演算子を解析する
+/// @param can_assign 
+static void subscript(bool can_assign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        expression();
+        emit_byte(OP_SET_INDEX);
+    } else {
+        emit_byte(OP_GET_INDEX);
+    }
+}
+
+/// @brief リストのリテラルを解析する
+static void list(bool can_assign) {
+    uint8_t count = 0;
+
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (count >= 255) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            count += 1;
+        } while (match(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emit_bytes(OP_BUILD_LIST, count);
+}
+
+/// @brief マップのリテラルを解析する．文の先頭の{はブロックになるので，式の中でだけ使える
+static void map(bool can_assign) {
+    uint8_t count = 0;
+
+    if (!check(TOKEN_RIGHT_BRACE)) {
+        do {
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            if (count >= 255) {
+                error("Can't have more than 255 entries in a map literal.");
+            }
+            count += 1;
+        } while (match(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emit_bytes(OP_BUILD_MAP, count);
+}
+
 /// @brief リテラルを解析する
 static void literal(bool can_assign) {
     switch (parser.previous.type) {
@@ -538,6 +614,8 @@ static void grouping(bool can_assign) {
 /// @return 追加した値のインデックス
 static uint8_t make_constant(Value value) { 
     int constant = add_constant(current_chunk(), value);
+    // 定数表の拡大で，関数が古い世代になっているかもしれない
+    write_barrier((Obj*)current->function, value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -580,6 +658,7 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     if (type != TYPE_SCRIPT) {
         // 関数宣言なら関数名を解析する
         current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        write_barrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->local_count];
@@ -599,7 +678,12 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
 /// @brief 数値リテラルを解析する
 static void number(bool can_assign) {
     double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    // 整数で表せるリテラルは整数の定数にする（リテラルは負にならないので-0はない）
+    if (value <= INT32_MAX && value == (double)(int32_t)value) {
+        emit_constant(INT_VAL((int32_t)value));
+    } else {
+        emit_constant(NUMBER_VAL(value));
+    }
 }
 
 /// @brief or演算子を解析する
@@ -630,7 +714,7 @@ static void and_(bool can_assign) {
 }
 
 static void string(bool can_assign) {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant(string_value(parser.previous.start + 1, parser.previous.length - 2));
 }
 
 /// @brief 変数名を解析する
@@ -688,19 +772,19 @@ static void super_(bool can_assign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(&parser.previous);
+    uint16_t selector = identifier_selector(&parser.previous);
 
     // 自クラスをプッシュ
     named_variable(synthetic_token("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list();
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, name);
+        emit_selector(OP_SUPER_INVOKE, selector);
         emit_byte(arg_count);
     } else {
         // スーパークラスをプッシュ
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_GET_SUPER, name);
+        emit_selector(OP_GET_SUPER, selector);
     }
 }
 
@@ -729,8 +813,10 @@ static void unary(bool can_assign) {
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-    [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
+    [TOKEN_LEFT_BRACE]    = {map,      NULL,   PREC_NONE},
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
     [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_DOT]           = {NULL,     dot,   PREC_CALL},
     [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -738,6 +824,7 @@ ParseRule rules[] = {
     [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
     [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
     [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
@@ -853,7 +940,7 @@ static void function(FunctionType type) {
 /// @brief メソッド宣言を解析する
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifier_constant(&parser.previous);
+    uint16_t selector = identifier_selector(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (
@@ -865,7 +952,7 @@ static void method() {
 
     function(type);
 
-    emit_bytes(OP_METHOD, constant);
+    emit_selector(OP_METHOD, selector);
 }
 
 /// @brief クラス宣言を解析する
@@ -927,10 +1014,9 @@ static void fun_declaration() {
     define_variable(global);
 }
 
-/// @brief 変数宣言を解析する
-static void var_declaration() {
-    uint8_t global = parse_variable("Expect variable name.");
-
+/// @brief 変数宣言の名前の後ろ（初期化式と;）を解析する
+/// @param global 定数表における，グローバル変数の名前のインデックス
+static void finish_var_declaration(uint8_t global) {
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -943,6 +1029,11 @@ static void var_declaration() {
     define_variable(global);
 }
 
+/// @brief 変数宣言を解析する
+static void var_declaration() {
+    finish_var_declaration(parse_variable("Expect variable name."));
+}
+
 /// @brief 式文を解析する
 static void expression_statement() {
     expression();
@@ -950,6 +1041,46 @@ static void expression_statement() {
     emit_byte(OP_POP);
 }
 
+/// @brief for-in文の残り（inの後ろ）を解析する．ループ変数はもう宣言してある．
+/// ローカル変数をループ変数，列挙するリストか配列，次の位置の順に並べ，OP_FOR_IN_NEXTで1つずつ進める
+static void for_in_statement() {
+    // ループ変数
+    emit_byte(OP_NIL);
+    mark_initialized();
+
+    // 列挙する値．マップはキーのリストにしておく
+    expression();
+    emit_byte(OP_FOR_IN_BEGIN);
+    add_local(synthetic_token(""));
+    mark_initialized();
+    uint8_t slot = (uint8_t)(current->local_count - 1);
+
+    // 次の位置
+    emit_constant(INT_VAL(0));
+    add_local(synthetic_token(""));
+    mark_initialized();
+
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for-in clause.");
+
+    int loop_start = current_chunk()->count;
+    emit_bytes(OP_FOR_IN_NEXT, slot);
+    int exit_jump = current_chunk()->count;
+    emit_bytes(0xff, 0xff);
+
+    statement();
+    emit_loop(loop_start);
+    patch_jump(exit_jump);
+
+    end_scope();
+}
+
+/// @brief 現在のトークンがinかどうかを判定する．inは予約語にせず，for文の中だけで区別する
+/// @return inならtrue
+static bool check_in() {
+    return check(TOKEN_IDENTIFIER) && parser.current.length == 2
+        && memcmp(parser.current.start, "in", 2) == 0;
+}
+
 /// @brief for文を解析する
 static void for_statement() {
     begin_scope();
@@ -960,7 +1091,13 @@ static void for_statement() {
     if (match(TOKEN_SEMICOLON)) {
         ;
     } else if (match(TOKEN_VAR)) {
-        var_declaration();
+        uint8_t global = parse_variable("Expect variable name.");
+        if (check_in()) {
+            advance();
+            for_in_statement();
+            return;
+        }
+        finish_var_declaration(global);
     } else {
         expression_statement();
     }
@@ -1147,6 +1284,15 @@ ObjFunction* compile(const char* source) {
     return parser.had_error ? NULL : function;
 }
 
+bool is_compiling() {
+    return current != NULL;
+}
+
+void abort_compile() {
+    current = NULL;
+    current_class = NULL;
+}
+
 void mark_compiler_roots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
@@ -12,4 +12,11 @@ ObjFunction* compile(const char* source);
 /// @brief コンパイラ使うオブジェクトをマークする
 void mark_compiler_roots();
 
+/// @brief コンパイル中かどうか
+/// @return コンパイル中の関数があるかどうか
+bool is_compiling();
+
+/// @brief コンパイルを途中でやめて，コンパイル中の関数を忘れる
+void abort_compile();
+
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 /// @brief チャンクを逆アセンブルする
 /// @param chunk 対象のチャンク
@@ -49,6 +50,20 @@ static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset
     return offset + 3;
 }
 
+/// @brief for-inの命令を逆アセンブルする
+/// @param name 名前
+/// @param chunk チャンク
+/// @param offset 開始位置
+/// @return 次の命令の開始位置
+static int for_in_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+
+    printf("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 4 + jump);
+    return offset + 4;
+}
+
 /// @brief 定数命令を逆アセンブルする
 /// @param name 名前
 /// @param chunk チャンク
@@ -62,18 +77,39 @@ static int constant_instruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+/// @brief セレクタの名前を得る．壊れたオペランドでも落ちないように範囲を確かめる
+/// @param selector セレクタ番号
+/// @return 名前．範囲外なら"<invalid selector>"
+static const char* selector_text(int selector) {
+    if (selector >= vm.selector_names.count) {
+        return "<invalid selector>";
+    }
+    return selector_name(selector)->chars;
+}
+
+/// @brief セレクタ番号をオペランドに持つ命令を逆アセンブルする
+/// @param name 名前
+/// @param chunk チャンク
+/// @param offset 開始位置
+/// @return 次の命令の開始位置
+static int selector_instruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t selector = (uint16_t)(chunk->code[offset + 1] << 8);
+    selector |= chunk->code[offset + 2];
+    printf("%-16s %4d '%s'\n", name, selector, selector_text(selector));
+    return offset + 3;
+}
+
 /// @brief INVOKE命令を逆アセンブルする
 /// @param name 
 /// @param chunk 
 /// @param offset 
 /// @return 
 static int invoke_instruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t arg_count = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, arg_count, constant);
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    uint16_t selector = (uint16_t)(chunk->code[offset + 1] << 8);
+    selector |= chunk->code[offset + 2];
+    uint8_t arg_count = chunk->code[offset + 3];
+    printf("%-16s (%d args) %4d '%s'\n", name, arg_count, selector, selector_text(selector));
+    return offset + 4;
 }
 
 /// @brief 命令を逆アセンブルする
@@ -112,13 +148,13 @@ int disassemble_instruction(Chunk* chunk, int offset) {
     case OP_SET_PROPERTY:
         return constant_instruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
-        return constant_instruction("OP_GET_SUPER", chunk, offset);
+        return selector_instruction("OP_GET_SUPER", chunk, offset);
     case OP_SET_LOCAL:
         return byte_instruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
         return constant_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return simple_instruction("OP_DEFINE_GLOBAL", offset);
+        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
         return constant_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_EQUAL:
@@ -189,7 +225,19 @@ int disassemble_instruction(Chunk* chunk, int offset) {
     case OP_INHERIT:
         return simple_instruction("OP_INHERIT", offset);
     case OP_METHOD:
-        return constant_instruction("OP_METHOD", chunk, offset);
+        return selector_instruction("OP_METHOD", chunk, offset);
+    case OP_BUILD_LIST:
+        return byte_instruction("OP_BUILD_LIST", chunk, offset);
+    case OP_GET_INDEX:
+        return simple_instruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+        return simple_instruction("OP_SET_INDEX", offset);
+    case OP_BUILD_MAP:
+        return byte_instruction("OP_BUILD_MAP", chunk, offset);
+    case OP_FOR_IN_BEGIN:
+        return simple_instruction("OP_FOR_IN_BEGIN", offset);
+    case OP_FOR_IN_NEXT:
+        return for_in_instruction("OP_FOR_IN_NEXT", chunk, offset);
     default:
         printf("unknown opcode %d\n", instruction);
         return offset + 1;
@@ -0,0 +1,418 @@
+#include "floatkernels.h"
+
+// FLOAT_KERNELS_NO_SIMDはcommon.hで定義するので，その後で判定する
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(FLOAT_KERNELS_NO_SIMD)
+#define FLOAT_KERNELS_SIMD
+#include <immintrin.h>
+#endif
+
+/// @brief レーンの部分和を決まった順で足し合わせる
+/// @param lanes FLOAT_KERNEL_LANES個の部分和
+/// @return 総和
+static double sum_lanes(const double* lanes) {
+    // 隣り合うレーンを組にして足すことを繰り返す
+    double sums[FLOAT_KERNEL_LANES];
+    for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+        sums[lane] = lanes[lane];
+    }
+    for (int width = FLOAT_KERNEL_LANES / 2; width > 0; width /= 2) {
+        for (int lane = 0; lane < width; lane++) {
+            sums[lane] = sums[2 * lane] + sums[2 * lane + 1];
+        }
+    }
+    return sums[0];
+}
+
+/// @brief レーンの最小値をまとめる．比較はSSEのminpdと同じく，比べられなければ後ろの引数を残す
+/// @param lanes FLOAT_KERNEL_LANES個の最小値
+/// @return 最小値
+static double min_lanes(const double* lanes) {
+    double result = lanes[0];
+    for (int lane = 1; lane < FLOAT_KERNEL_LANES; lane++) {
+        result = lanes[lane] < result ? lanes[lane] : result;
+    }
+    return result;
+}
+
+/// @brief レーンの最大値をまとめる．比較はSSEのmaxpdと同じく，比べられなければ後ろの引数を残す
+/// @param lanes FLOAT_KERNEL_LANES個の最大値
+/// @return 最大値
+static double max_lanes(const double* lanes) {
+    double result = lanes[0];
+    for (int lane = 1; lane < FLOAT_KERNEL_LANES; lane++) {
+        result = lanes[lane] > result ? lanes[lane] : result;
+    }
+    return result;
+}
+
+// スカラーの実装．SIMDのない環境ではこれを使う
+
+static double sum_scalar(const double* values, int count) {
+    double lanes[FLOAT_KERNEL_LANES] = {0};
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+            lanes[lane] += values[i + lane];
+        }
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] += values[i];
+    }
+    return sum_lanes(lanes);
+}
+
+static double dot_scalar(const double* a, const double* b, int count) {
+    double lanes[FLOAT_KERNEL_LANES] = {0};
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+            lanes[lane] += a[i + lane] * b[i + lane];
+        }
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] += a[i] * b[i];
+    }
+    return sum_lanes(lanes);
+}
+
+static void scale_scalar(double* values, int count, double factor) {
+    for (int i = 0; i < count; i++) {
+        values[i] *= factor;
+    }
+}
+
+static void offset_scalar(double* values, int count, double addend) {
+    for (int i = 0; i < count; i++) {
+        values[i] += addend;
+    }
+}
+
+static void add_scalar(double* values, const double* other, int count) {
+    for (int i = 0; i < count; i++) {
+        values[i] += other[i];
+    }
+}
+
+static double min_scalar(const double* values, int count) {
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+        lanes[lane] = values[0];
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+            lanes[lane] = values[i + lane] < lanes[lane] ? values[i + lane] : lanes[lane];
+        }
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] = values[i] < lanes[lane] ? values[i] : lanes[lane];
+    }
+    return min_lanes(lanes);
+}
+
+static double max_scalar(const double* values, int count) {
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+        lanes[lane] = values[0];
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int lane = 0; lane < FLOAT_KERNEL_LANES; lane++) {
+            lanes[lane] = values[i + lane] > lanes[lane] ? values[i + lane] : lanes[lane];
+        }
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] = values[i] > lanes[lane] ? values[i] : lanes[lane];
+    }
+    return max_lanes(lanes);
+}
+
+static const FloatKernels scalar_kernels = {
+    "scalar", sum_scalar, dot_scalar, scale_scalar, offset_scalar, add_scalar, min_scalar, max_scalar,
+};
+
+#ifdef FLOAT_KERNELS_SIMD
+
+// SSE2の実装．x86-64では常に使える．レーンを2つずつレジスタに分けて持つ．
+// レジスタの配列を回るループは定数回なので，コンパイラが展開してレジスタに置く
+#define SSE2_REGISTERS (FLOAT_KERNEL_LANES / 2)
+
+static double sum_sse2(const double* values, int count) {
+    __m128d acc[SSE2_REGISTERS];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        acc[r] = _mm_setzero_pd();
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            acc[r] = _mm_add_pd(acc[r], _mm_loadu_pd(values + i + 2 * r));
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        _mm_storeu_pd(lanes + 2 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] += values[i];
+    }
+    return sum_lanes(lanes);
+}
+
+static double dot_sse2(const double* a, const double* b, int count) {
+    __m128d acc[SSE2_REGISTERS];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        acc[r] = _mm_setzero_pd();
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            __m128d product = _mm_mul_pd(_mm_loadu_pd(a + i + 2 * r), _mm_loadu_pd(b + i + 2 * r));
+            acc[r] = _mm_add_pd(acc[r], product);
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        _mm_storeu_pd(lanes + 2 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] += a[i] * b[i];
+    }
+    return sum_lanes(lanes);
+}
+
+static void scale_sse2(double* values, int count, double factor) {
+    __m128d factors = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            _mm_storeu_pd(values + i + 2 * r, _mm_mul_pd(_mm_loadu_pd(values + i + 2 * r), factors));
+        }
+    }
+    for (; i < count; i++) {
+        values[i] *= factor;
+    }
+}
+
+static void offset_sse2(double* values, int count, double addend) {
+    __m128d addends = _mm_set1_pd(addend);
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            _mm_storeu_pd(values + i + 2 * r, _mm_add_pd(_mm_loadu_pd(values + i + 2 * r), addends));
+        }
+    }
+    for (; i < count; i++) {
+        values[i] += addend;
+    }
+}
+
+static void add_sse2(double* values, const double* other, int count) {
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            __m128d sum = _mm_add_pd(_mm_loadu_pd(values + i + 2 * r), _mm_loadu_pd(other + i + 2 * r));
+            _mm_storeu_pd(values + i + 2 * r, sum);
+        }
+    }
+    for (; i < count; i++) {
+        values[i] += other[i];
+    }
+}
+
+static double min_sse2(const double* values, int count) {
+    __m128d acc[SSE2_REGISTERS];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        acc[r] = _mm_set1_pd(values[0]);
+    }
+    int i = 0;
+    // minpd(x, acc)は x < acc ? x : acc なので，スカラーの実装と同じ結果になる
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            acc[r] = _mm_min_pd(_mm_loadu_pd(values + i + 2 * r), acc[r]);
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        _mm_storeu_pd(lanes + 2 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] = values[i] < lanes[lane] ? values[i] : lanes[lane];
+    }
+    return min_lanes(lanes);
+}
+
+static double max_sse2(const double* values, int count) {
+    __m128d acc[SSE2_REGISTERS];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        acc[r] = _mm_set1_pd(values[0]);
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < SSE2_REGISTERS; r++) {
+            acc[r] = _mm_max_pd(_mm_loadu_pd(values + i + 2 * r), acc[r]);
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < SSE2_REGISTERS; r++) {
+        _mm_storeu_pd(lanes + 2 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] = values[i] > lanes[lane] ? values[i] : lanes[lane];
+    }
+    return max_lanes(lanes);
+}
+
+static const FloatKernels sse2_kernels = {
+    "sse2", sum_sse2, dot_sse2, scale_sse2, offset_sse2, add_sse2, min_sse2, max_sse2,
+};
+
+// AVXの実装．レーンを4つずつレジスタに分けて持つ．倍精度の演算にはAVX2の整数命令は要らない
+#define AVX_REGISTERS (FLOAT_KERNEL_LANES / 4)
+
+__attribute__((target("avx")))
+static double sum_avx(const double* values, int count) {
+    __m256d acc[AVX_REGISTERS];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        acc[r] = _mm256_setzero_pd();
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            acc[r] = _mm256_add_pd(acc[r], _mm256_loadu_pd(values + i + 4 * r));
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        _mm256_storeu_pd(lanes + 4 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] += values[i];
+    }
+    return sum_lanes(lanes);
+}
+
+__attribute__((target("avx")))
+static double dot_avx(const double* a, const double* b, int count) {
+    __m256d acc[AVX_REGISTERS];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        acc[r] = _mm256_setzero_pd();
+    }
+    int i = 0;
+    // FMAは丸めが変わるので使わない
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            __m256d product = _mm256_mul_pd(_mm256_loadu_pd(a + i + 4 * r), _mm256_loadu_pd(b + i + 4 * r));
+            acc[r] = _mm256_add_pd(acc[r], product);
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        _mm256_storeu_pd(lanes + 4 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] += a[i] * b[i];
+    }
+    return sum_lanes(lanes);
+}
+
+__attribute__((target("avx")))
+static void scale_avx(double* values, int count, double factor) {
+    __m256d factors = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            _mm256_storeu_pd(values + i + 4 * r, _mm256_mul_pd(_mm256_loadu_pd(values + i + 4 * r), factors));
+        }
+    }
+    for (; i < count; i++) {
+        values[i] *= factor;
+    }
+}
+
+__attribute__((target("avx")))
+static void offset_avx(double* values, int count, double addend) {
+    __m256d addends = _mm256_set1_pd(addend);
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            _mm256_storeu_pd(values + i + 4 * r, _mm256_add_pd(_mm256_loadu_pd(values + i + 4 * r), addends));
+        }
+    }
+    for (; i < count; i++) {
+        values[i] += addend;
+    }
+}
+
+__attribute__((target("avx")))
+static void add_avx(double* values, const double* other, int count) {
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            __m256d sum = _mm256_add_pd(_mm256_loadu_pd(values + i + 4 * r), _mm256_loadu_pd(other + i + 4 * r));
+            _mm256_storeu_pd(values + i + 4 * r, sum);
+        }
+    }
+    for (; i < count; i++) {
+        values[i] += other[i];
+    }
+}
+
+__attribute__((target("avx")))
+static double min_avx(const double* values, int count) {
+    __m256d acc[AVX_REGISTERS];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        acc[r] = _mm256_set1_pd(values[0]);
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            acc[r] = _mm256_min_pd(_mm256_loadu_pd(values + i + 4 * r), acc[r]);
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        _mm256_storeu_pd(lanes + 4 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] = values[i] < lanes[lane] ? values[i] : lanes[lane];
+    }
+    return min_lanes(lanes);
+}
+
+__attribute__((target("avx")))
+static double max_avx(const double* values, int count) {
+    __m256d acc[AVX_REGISTERS];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        acc[r] = _mm256_set1_pd(values[0]);
+    }
+    int i = 0;
+    for (; i + FLOAT_KERNEL_LANES <= count; i += FLOAT_KERNEL_LANES) {
+        for (int r = 0; r < AVX_REGISTERS; r++) {
+            acc[r] = _mm256_max_pd(_mm256_loadu_pd(values + i + 4 * r), acc[r]);
+        }
+    }
+    double lanes[FLOAT_KERNEL_LANES];
+    for (int r = 0; r < AVX_REGISTERS; r++) {
+        _mm256_storeu_pd(lanes + 4 * r, acc[r]);
+    }
+    for (int lane = 0; i < count; i++, lane++) {
+        lanes[lane] = values[i] > lanes[lane] ? values[i] : lanes[lane];
+    }
+    return max_lanes(lanes);
+}
+
+static const FloatKernels avx_kernels = {
+    "avx", sum_avx, dot_avx, scale_avx, offset_avx, add_avx, min_avx, max_avx,
+};
+
+#endif
+
+const FloatKernels* float_kernels = &scalar_kernels;
+
+void init_float_kernels() {
+    #ifdef FLOAT_KERNELS_SIMD
+    // __builtin_cpu_supportsは，OSがYMMレジスタを保存するかどうかも調べる
+    __builtin_cpu_init();
+    float_kernels = __builtin_cpu_supports("avx") ? &avx_kernels : &sse2_kernels;
+    #endif
+}
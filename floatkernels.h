@@ -0,0 +1,40 @@
+/*
+浮動小数点数の配列をまとめて処理するカーネル．起動時にCPUの機能を調べて，スカラー・SSE2・AVXの実装から選ぶ．
+総和などの集約は，どの実装でも要素をFLOAT_KERNEL_LANES個のレーンに振り分けて同じ順で足すので，結果はビット単位で一致する
+*/
+
+#ifndef CLOX_FLOATKERNELS_H
+#define CLOX_FLOATKERNELS_H
+
+#include "common.h"
+
+// 集約で使うレーンの数．位置iの要素はレーンi % FLOAT_KERNEL_LANESに集める
+#define FLOAT_KERNEL_LANES 16
+
+/// @brief 浮動小数点数の配列を処理するカーネルの表
+typedef struct {
+    /// @brief 実装の名前（"scalar"，"sse2"，"avx"）
+    const char* name;
+    /// @brief 要素の総和を求める
+    double (*sum)(const double* values, int count);
+    /// @brief 2つの配列の内積を求める
+    double (*dot)(const double* a, const double* b, int count);
+    /// @brief 全ての要素に定数を掛ける
+    void (*scale)(double* values, int count, double factor);
+    /// @brief 全ての要素に定数を足す
+    void (*offset)(double* values, int count, double addend);
+    /// @brief 要素ごとに別の配列の要素を足す
+    void (*add)(double* values, const double* other, int count);
+    /// @brief 最小の要素を求める．countは1以上
+    double (*min)(const double* values, int count);
+    /// @brief 最大の要素を求める．countは1以上
+    double (*max)(const double* values, int count);
+} FloatKernels;
+
+/// @brief 選ばれたカーネル．init_float_kernelsを呼ぶまではスカラーの実装
+extern const FloatKernels* float_kernels;
+
+/// @brief CPUの機能を調べてカーネルを選ぶ
+void init_float_kernels();
+
+#endif
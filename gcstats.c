@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gcstats.h"
+#include "vm.h"
+
+GcStats gc_stats;
+
+/// @brief JSONの報告やgcStatで使う，オブジェクトの種類の名前
+static const char* const type_names[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD] = "bound_method",
+    [OBJ_CLASS] = "class",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_FLOAT_ARRAY] = "float_array",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_LIST] = "list",
+    [OBJ_MAP] = "map",
+    [OBJ_NATIVE] = "native",
+    [OBJ_ROPE] = "rope",
+    [OBJ_STRING] = "string",
+    [OBJ_STRING_BUILDER] = "string_builder",
+    [OBJ_UPVALUE] = "upvalue",
+};
+
+void count_pause(uint64_t pause) {
+    gc_stats.pause_count += 1;
+    gc_stats.pause_total += pause;
+
+    // マイクロ秒の2進の桁数を区間の番号にする
+    uint64_t usec = pause / 1000;
+    int bucket = usec == 0 ? 0 : 64 - __builtin_clzll(usec);
+    if (bucket >= PAUSE_BUCKET_COUNT) {
+        bucket = PAUSE_BUCKET_COUNT - 1;
+    }
+    gc_stats.pause_buckets[bucket] += 1;
+}
+
+void snapshot_live_objects() {
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        TypeStats* stats = &gc_stats.types[i];
+        stats->live = stats->allocated - stats->freed;
+        stats->live_bytes = stats->bytes_allocated - stats->bytes_freed;
+    }
+}
+
+/// @brief 最後のGCの後に生きていたバイト数を合計する
+/// @return バイト数
+static uint64_t total_live_bytes() {
+    uint64_t total = 0;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        total += gc_stats.types[i].live_bytes;
+    }
+    return total;
+}
+
+/// @brief オブジェクトのセルと配列を合わせて割り当てたバイト数を求める
+/// @return バイト数
+static uint64_t total_bytes_allocated() {
+    uint64_t total = gc_stats.array_bytes_allocated;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        total += gc_stats.types[i].bytes_allocated;
+    }
+    return total;
+}
+
+/// @brief オブジェクトのセルと配列を合わせて解放したバイト数を求める
+/// @return バイト数
+static uint64_t total_bytes_freed() {
+    uint64_t total = gc_stats.array_bytes_freed;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        total += gc_stats.types[i].bytes_freed;
+    }
+    return total;
+}
+
+/// @brief オブジェクトの種類ごとの統計を名前で探す
+/// @param name "types."の後ろの名前（"string.live"など）
+/// @param value 値を書き込む先
+/// @return 名前が見つかったかどうか
+static bool find_type_stat(const char* name, double* value) {
+    const char* dot = strchr(name, '.');
+    if (dot == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        size_t length = strlen(type_names[i]);
+        if ((size_t)(dot - name) != length || strncmp(name, type_names[i], length) != 0) {
+            continue;
+        }
+
+        TypeStats* stats = &gc_stats.types[i];
+        const char* field = dot + 1;
+        if (strcmp(field, "allocated") == 0) {
+            *value = (double)stats->allocated;
+        } else if (strcmp(field, "freed") == 0) {
+            *value = (double)stats->freed;
+        } else if (strcmp(field, "bytes_allocated") == 0) {
+            *value = (double)stats->bytes_allocated;
+        } else if (strcmp(field, "bytes_freed") == 0) {
+            *value = (double)stats->bytes_freed;
+        } else if (strcmp(field, "live") == 0) {
+            *value = (double)stats->live;
+        } else if (strcmp(field, "live_bytes") == 0) {
+            *value = (double)stats->live_bytes;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool find_gc_stat(const char* name, double* value) {
+    if (strncmp(name, "types.", 6) == 0) {
+        return find_type_stat(name + 6, value);
+    }
+
+    if (strcmp(name, "collections.minor") == 0) {
+        *value = (double)gc_stats.minor_collections;
+    } else if (strcmp(name, "collections.full") == 0) {
+        *value = (double)gc_stats.full_collections;
+    } else if (strcmp(name, "collections.compactions") == 0) {
+        *value = (double)gc_stats.compactions;
+    } else if (strcmp(name, "pauses.count") == 0) {
+        *value = (double)gc_stats.pause_count;
+    } else if (strcmp(name, "pauses.total_ns") == 0) {
+        *value = (double)gc_stats.pause_total;
+    } else if (strcmp(name, "pauses.max_ns") == 0) {
+        *value = (double)vm.gc_max_pause;
+    } else if (strcmp(name, "heap.bytes") == 0) {
+        *value = (double)vm.bytes_allocated;
+    } else if (strcmp(name, "heap.peak_bytes") == 0) {
+        *value = (double)gc_stats.peak_heap;
+    } else if (strcmp(name, "heap.live_bytes") == 0) {
+        *value = (double)total_live_bytes();
+    } else if (strcmp(name, "heap.next_gc") == 0) {
+        *value = (double)vm.next_gc;
+    } else if (strcmp(name, "heap.growth") == 0) {
+        *value = vm.gc_growth;
+    } else if (strcmp(name, "arrays.bytes_allocated") == 0) {
+        *value = (double)gc_stats.array_bytes_allocated;
+    } else if (strcmp(name, "arrays.bytes_freed") == 0) {
+        *value = (double)gc_stats.array_bytes_freed;
+    } else if (strcmp(name, "bytes_allocated") == 0) {
+        *value = (double)total_bytes_allocated();
+    } else if (strcmp(name, "bytes_freed") == 0) {
+        *value = (double)total_bytes_freed();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void print_gc_stats_json(FILE* file) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"collections\": {\"minor\": %llu, \"full\": %llu, \"compactions\": %llu},\n",
+        (unsigned long long)gc_stats.minor_collections,
+        (unsigned long long)gc_stats.full_collections,
+        (unsigned long long)gc_stats.compactions);
+
+    fprintf(file, "  \"pauses\": {\"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"histogram\": [",
+        (unsigned long long)gc_stats.pause_count,
+        (unsigned long long)gc_stats.pause_total,
+        (unsigned long long)vm.gc_max_pause);
+    for (int i = 0; i < PAUSE_BUCKET_COUNT; i++) {
+        if (i == PAUSE_BUCKET_COUNT - 1) {
+            fprintf(file, "{\"below_us\": null, \"count\": %llu}",
+                (unsigned long long)gc_stats.pause_buckets[i]);
+        } else {
+            fprintf(file, "{\"below_us\": %llu, \"count\": %llu}, ",
+                1ull << i, (unsigned long long)gc_stats.pause_buckets[i]);
+        }
+    }
+    fprintf(file, "]},\n");
+
+    fprintf(file, "  \"heap\": {\"peak_bytes\": %zu, \"live_bytes\": %llu, \"next_gc\": %zu, \"growth\": %.3f},\n",
+        gc_stats.peak_heap, (unsigned long long)total_live_bytes(), vm.next_gc, vm.gc_growth);
+    fprintf(file, "  \"arrays\": {\"bytes_allocated\": %llu, \"bytes_freed\": %llu},\n",
+        (unsigned long long)gc_stats.array_bytes_allocated,
+        (unsigned long long)gc_stats.array_bytes_freed);
+    fprintf(file, "  \"bytes_allocated\": %llu,\n", (unsigned long long)total_bytes_allocated());
+    fprintf(file, "  \"bytes_freed\": %llu,\n", (unsigned long long)total_bytes_freed());
+
+    fprintf(file, "  \"types\": {\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        TypeStats* stats = &gc_stats.types[i];
+        fprintf(file, "    \"%s\": {\"allocated\": %llu, \"freed\": %llu, \"bytes_allocated\": %llu, "
+            "\"bytes_freed\": %llu, \"live\": %llu, \"live_bytes\": %llu}%s\n",
+            type_names[i],
+            (unsigned long long)stats->allocated,
+            (unsigned long long)stats->freed,
+            (unsigned long long)stats->bytes_allocated,
+            (unsigned long long)stats->bytes_freed,
+            (unsigned long long)stats->live,
+            (unsigned long long)stats->live_bytes,
+            i == OBJ_TYPE_COUNT - 1 ? "" : ",");
+    }
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+}
@@ -0,0 +1,114 @@
+/*
+GCと割り当ての統計．常に数えておき，終了時の報告やgcStatから読む
+*/
+
+#ifndef CLOX_GCSTATS_H
+#define CLOX_GCSTATS_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// 停止時間のヒストグラムの区間の数．区間iは2^(i-1)マイクロ秒以上2^iマイクロ秒未満で，最後の区間は上限がない
+#define PAUSE_BUCKET_COUNT 24
+
+/// @brief オブジェクトの種類ごとの統計
+typedef struct {
+    /// @brief 割り当てたオブジェクトの数
+    uint64_t allocated;
+    /// @brief 解放したオブジェクトの数
+    uint64_t freed;
+    /// @brief 割り当てたセルのバイト数
+    uint64_t bytes_allocated;
+    /// @brief 解放したセルのバイト数
+    uint64_t bytes_freed;
+    /// @brief 最後のGCの後に生きていたオブジェクトの数
+    uint64_t live;
+    /// @brief 最後のGCの後に生きていたセルのバイト数
+    uint64_t live_bytes;
+} TypeStats;
+
+/// @brief GCと割り当ての統計
+typedef struct {
+    /// @brief 若い世代のGCの回数
+    uint64_t minor_collections;
+    /// @brief 全世代のGCの回数
+    uint64_t full_collections;
+    /// @brief コンパクションの回数
+    uint64_t compactions;
+
+    /// @brief GCによる停止の回数
+    uint64_t pause_count;
+    /// @brief GCによる停止時間の合計（ナノ秒）
+    uint64_t pause_total;
+    /// @brief 停止時間のヒストグラム
+    uint64_t pause_buckets[PAUSE_BUCKET_COUNT];
+
+    /// @brief vm.bytes_allocatedの最大値
+    size_t peak_heap;
+
+    /// @brief オブジェクトの外に割り当てた配列（表や命令の配列など）のバイト数
+    uint64_t array_bytes_allocated;
+    /// @brief オブジェクトの外に割り当てた配列を解放したバイト数
+    uint64_t array_bytes_freed;
+
+    /// @brief オブジェクトの種類ごとの統計
+    TypeStats types[OBJ_TYPE_COUNT];
+} GcStats;
+
+/// @brief 唯一の統計
+extern GcStats gc_stats;
+
+/// @brief オブジェクトの割り当てを数える
+/// @param type オブジェクトの種類
+/// @param size セルのバイト数
+static inline void count_allocation(ObjType type, size_t size) {
+    gc_stats.types[type].allocated += 1;
+    gc_stats.types[type].bytes_allocated += size;
+}
+
+/// @brief ヒープにある（まだ解放していない）オブジェクトの数を得る
+/// @return オブジェクトの数
+static inline uint64_t heap_object_count() {
+    uint64_t count = 0;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        count += gc_stats.types[i].allocated - gc_stats.types[i].freed;
+    }
+    return count;
+}
+
+/// @brief オブジェクトの解放を数える
+/// @param type オブジェクトの種類
+/// @param size セルのバイト数
+static inline void count_free(ObjType type, size_t size) {
+    gc_stats.types[type].freed += 1;
+    gc_stats.types[type].bytes_freed += size;
+}
+
+/// @brief ヒープの大きさの最大値を更新する
+/// @param heap_size 現在のヒープのバイト数
+static inline void update_peak_heap(size_t heap_size) {
+    if (heap_size > gc_stats.peak_heap) {
+        gc_stats.peak_heap = heap_size;
+    }
+}
+
+/// @brief GCによる停止を数える
+/// @param pause 停止時間（ナノ秒）
+void count_pause(uint64_t pause);
+
+/// @brief GCの後に，種類ごとの生きているオブジェクトの数とバイト数を記録する
+void snapshot_live_objects();
+
+/// @brief 名前で統計の値を探す．名前はJSONの報告のキーを"."でつないだもの（"collections.full"，"types.string.live"など）
+/// @param name 統計の名前
+/// @param value 値を書き込む先
+/// @return 名前が見つかったかどうか
+bool find_gc_stat(const char* name, double* value);
+
+/// @brief 統計をJSONで書き出す
+/// @param file 書き出し先
+void print_gc_stats_json(FILE* file);
+
+#endif
@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gcstats.h"
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+// ページの先頭に置くヘッダの大きさ．セルはこの後ろから並べる
+#define HEAP_HEADER_SIZE \
+    ((sizeof(HeapPage) + HEAP_GRANULE - 1) / HEAP_GRANULE * HEAP_GRANULE)
+
+// OSのページの大きさ
+#define OS_PAGE_SIZE 4096
+
+// これより大きいオブジェクトは大きなページに置く
+#define HEAP_MAX_CELL 2048
+
+// 使われているセルがこの割合（百分率）より少ないページを，コンパクションで空にする
+#define HEAP_SPARSE_PERCENT 50
+
+// コンパクションを始める，空けられるページの数の下限
+#define HEAP_COMPACT_MIN_PAGES 4
+
+/// @brief サイズクラスごとのセルの大きさ
+static const size_t cell_sizes[] = {
+    16, 24, 32, 40, 48, 56, 64, 72,
+    80, 96, 112, 128,
+    144, 160, 176, 192, 208, 224, 240, 256,
+    288, 320, 352, 384, 416, 448, 480, 512,
+    576, 640, 704, 768, 832, 896, 960, 1024,
+    1152, 1280, 1408, 1536, 1664, 1792, 1920, 2048,
+};
+
+// サイズクラスの数
+#define SIZE_CLASS_COUNT ((int)(sizeof(cell_sizes) / sizeof(cell_sizes[0])))
+
+// 大きなページのサイズクラスの番号
+#define LARGE_CLASS SIZE_CLASS_COUNT
+
+/// @brief 同じ大きさのセルを持つページの集まり
+typedef struct {
+    /// @brief 全てのページ
+    HeapPage* pages;
+    /// @brief 割り当てに使っているページ
+    HeapPage* current;
+    /// @brief 空きセルのあるページ
+    HeapPage* available;
+    /// @brief 次にsweepするページ
+    HeapPage* sweep_cursor;
+} SizeClass;
+
+/// @brief サイズクラス．最後の要素は大きなページ
+static SizeClass size_classes[SIZE_CLASS_COUNT + 1];
+
+/// @brief オブジェクトの大きさ（HEAP_GRANULE単位）からサイズクラスの番号を引く表
+static uint8_t class_of_granules[HEAP_MAX_CELL / HEAP_GRANULE + 1];
+
+/// @brief class_of_granulesを作ったかどうか
+static bool class_table_ready = false;
+
+/// @brief OSに返した空きページ
+static HeapPage* empty_pages = NULL;
+
+/// @brief まだsweepしていないページの数
+static int pages_to_sweep = 0;
+
+/// @brief 次にsweepするサイズクラス
+static int sweep_class = 0;
+
+/// @brief class_of_granulesを作る
+static void build_class_table() {
+    int index = 0;
+    for (int granules = 0; granules <= HEAP_MAX_CELL / HEAP_GRANULE; granules++) {
+        while (cell_sizes[index] < (size_t)granules * HEAP_GRANULE) {
+            index += 1;
+        }
+        class_of_granules[granules] = (uint8_t)index;
+    }
+    class_table_ready = true;
+}
+
+/// @brief HEAP_PAGE_SIZEに揃ったメモリをOSから確保する
+/// @param size バイト数（OS_PAGE_SIZEの倍数）
+/// @return 確保したメモリ．確保できなければNULL
+static void* map_aligned(size_t size) {
+    size_t total = size + HEAP_PAGE_SIZE;
+    char* raw = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    uintptr_t aligned = ((uintptr_t)raw + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+    size_t head = aligned - (uintptr_t)raw;
+    size_t tail = total - head - size;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    if (tail > 0) {
+        munmap((char*)aligned + size, tail);
+    }
+
+    return (void*)aligned;
+}
+
+/// @brief ページをサイズクラスの連結リストの先頭に加える
+/// @param class_ サイズクラス
+/// @param page ページ
+static void link_page(SizeClass* class_, HeapPage* page) {
+    page->prev = NULL;
+    page->next = class_->pages;
+    if (class_->pages != NULL) {
+        class_->pages->prev = page;
+    }
+    class_->pages = page;
+}
+
+/// @brief ページをサイズクラスの連結リストから外す
+/// @param class_ サイズクラス
+/// @param page ページ
+static void unlink_page(SizeClass* class_, HeapPage* page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        class_->pages = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    if (class_->sweep_cursor == page) {
+        class_->sweep_cursor = page->next;
+    }
+}
+
+/// @brief 空きセルのあるページの連結リストに加える
+/// @param class_ サイズクラス
+/// @param page ページ
+static void add_available(SizeClass* class_, HeapPage* page) {
+    page->is_available = true;
+    page->prev_available = NULL;
+    page->next_available = class_->available;
+    if (class_->available != NULL) {
+        class_->available->prev_available = page;
+    }
+    class_->available = page;
+}
+
+/// @brief 空きセルのあるページの連結リストから外す
+/// @param class_ サイズクラス
+/// @param page ページ
+static void remove_available(SizeClass* class_, HeapPage* page) {
+    if (page->prev_available != NULL) {
+        page->prev_available->next_available = page->next_available;
+    } else {
+        class_->available = page->next_available;
+    }
+    if (page->next_available != NULL) {
+        page->next_available->prev_available = page->prev_available;
+    }
+    page->is_available = false;
+}
+
+/// @brief ページのヘッダを初期化する
+/// @param page ページ
+/// @param size_class サイズクラスの番号
+/// @param cell_size セルの大きさ
+/// @param page_size ページの大きさ
+static void init_page(HeapPage* page, int size_class, size_t cell_size, size_t page_size) {
+    page->next_available = NULL;
+    page->prev_available = NULL;
+    page->free_list = NULL;
+    page->cell_size = cell_size;
+    page->page_size = page_size;
+    page->size_class = size_class;
+    page->live_count = 0;
+    page->is_available = false;
+    page->needs_sweep = false;
+    page->evacuating = false;
+    memset(page->alloc_bits, 0, sizeof(page->alloc_bits));
+    memset(page->mark_bits, 0, sizeof(page->mark_bits));
+}
+
+/// @brief サイズクラスに新しいページを加える．OSに返した空きページがあれば使い回す
+/// @param size_class サイズクラスの番号
+/// @return ページ．確保できなければNULL
+static HeapPage* new_page(int size_class) {
+    HeapPage* page = empty_pages;
+    if (page != NULL) {
+        empty_pages = page->next;
+    } else {
+        page = (HeapPage*)map_aligned(HEAP_PAGE_SIZE);
+        if (page == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t cell_size = cell_sizes[size_class];
+    init_page(page, size_class, cell_size, HEAP_PAGE_SIZE);
+
+    // アドレスの順に割り当てるように，後ろのセルから空きセルの連結リストに積む
+    size_t cell_count = (HEAP_PAGE_SIZE - HEAP_HEADER_SIZE) / cell_size;
+    for (size_t i = cell_count; i > 0; i--) {
+        void** cell = (void**)((char*)page + HEAP_HEADER_SIZE + (i - 1) * cell_size);
+        *cell = page->free_list;
+        page->free_list = cell;
+    }
+
+    link_page(&size_classes[size_class], page);
+    return page;
+}
+
+/// @brief 空のページをOSに返す．ヘッダは残して，後で使い回す
+/// @param page 空のページ
+static void release_page(HeapPage* page) {
+    SizeClass* class_ = &size_classes[page->size_class];
+    unlink_page(class_, page);
+    if (page->is_available) {
+        remove_available(class_, page);
+    }
+
+    // ヘッダを含むOSのページは残す
+    uintptr_t start = ((uintptr_t)page + HEAP_HEADER_SIZE + OS_PAGE_SIZE - 1) & ~(uintptr_t)(OS_PAGE_SIZE - 1);
+    madvise((void*)start, (uintptr_t)page + HEAP_PAGE_SIZE - start, MADV_DONTNEED);
+
+    page->next = empty_pages;
+    empty_pages = page;
+}
+
+/// @brief ページのマークのついていないオブジェクトを解放して，セルを空ける
+/// @param page ページ
+/// @param may_release 空になったページをOSに返してよいかどうか
+static void sweep_page(HeapPage* page, bool may_release) {
+    page->needs_sweep = false;
+    pages_to_sweep -= 1;
+
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        uint64_t garbage = page->alloc_bits[i] & ~page->mark_bits[i];
+        while (garbage != 0) {
+            int bit = __builtin_ctzll(garbage);
+            garbage &= garbage - 1;
+
+            Obj* object = (Obj*)((char*)page + ((size_t)i * 64 + bit) * HEAP_GRANULE);
+            count_free(object->type, page->cell_size);
+            free_object(object);
+
+            page->alloc_bits[i] &= ~((uint64_t)1 << bit);
+            *(void**)object = page->free_list;
+            page->free_list = object;
+            page->live_count -= 1;
+            vm.bytes_allocated -= page->cell_size;
+        }
+    }
+
+    SizeClass* class_ = &size_classes[page->size_class];
+    if (page->size_class == LARGE_CLASS) {
+        if (page->live_count == 0) {
+            unlink_page(class_, page);
+            munmap(page, page->page_size);
+        }
+        return;
+    }
+
+    if (page == class_->current) {
+        return;
+    }
+
+    if (page->live_count == 0 && may_release) {
+        release_page(page);
+    } else if (page->free_list != NULL && !page->is_available) {
+        add_available(class_, page);
+    }
+}
+
+/// @brief 大きなオブジェクトを，それだけを置くページに割り当てる
+/// @param size オブジェクトのバイト数
+/// @return オブジェクト．確保できなければNULL
+static Obj* allocate_large(size_t size) {
+    size_t page_size = (HEAP_HEADER_SIZE + size + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE * OS_PAGE_SIZE;
+    HeapPage* page = (HeapPage*)map_aligned(page_size);
+    if (page == NULL) {
+        return NULL;
+    }
+    init_page(page, LARGE_CLASS, size, page_size);
+    link_page(&size_classes[LARGE_CLASS], page);
+
+    Obj* object = (Obj*)((char*)page + HEAP_HEADER_SIZE);
+    page->alloc_bits[granule_of(object) / 64] |= (uint64_t)1 << (granule_of(object) % 64);
+    page->live_count = 1;
+    vm.bytes_allocated += size;
+    return object;
+}
+
+/// @brief セルを割り当てるページを探す
+/// @param size_class サイズクラスの番号
+/// @return 空きセルのあるページ．確保できなければNULL
+static HeapPage* find_page(int size_class) {
+    SizeClass* class_ = &size_classes[size_class];
+
+    // sweep中なら，まだsweepしていないページから空きセルを作る
+    while (class_->available == NULL && class_->sweep_cursor != NULL) {
+        HeapPage* page = class_->sweep_cursor;
+        class_->sweep_cursor = page->next;
+        if (page->needs_sweep) {
+            sweep_page(page, false);
+        }
+    }
+
+    if (class_->available != NULL) {
+        HeapPage* page = class_->available;
+        if (page->needs_sweep) {
+            sweep_page(page, false);
+        }
+        remove_available(class_, page);
+        return page;
+    }
+
+    return new_page(size_class);
+}
+
+Obj* heap_allocate(size_t size) {
+    if (size > HEAP_MAX_CELL) {
+        return allocate_large((size + HEAP_GRANULE - 1) / HEAP_GRANULE * HEAP_GRANULE);
+    }
+
+    if (!class_table_ready) {
+        build_class_table();
+    }
+
+    int size_class = class_of_granules[(size + HEAP_GRANULE - 1) / HEAP_GRANULE];
+    SizeClass* class_ = &size_classes[size_class];
+
+    HeapPage* page = class_->current;
+    if (page != NULL && page->needs_sweep) {
+        // sweep前のページでは，マークのついていないオブジェクトがごみとして扱われるので，先にsweepする
+        sweep_page(page, false);
+    }
+    if (page == NULL || page->free_list == NULL) {
+        page = find_page(size_class);
+        if (page == NULL) {
+            return NULL;
+        }
+        class_->current = page;
+    }
+
+    void** cell = (void**)page->free_list;
+    page->free_list = *cell;
+    page->live_count += 1;
+    vm.bytes_allocated += page->cell_size;
+
+    Obj* object = (Obj*)cell;
+    size_t granule = granule_of(object);
+    page->alloc_bits[granule / 64] |= (uint64_t)1 << (granule % 64);
+    heap_clear_mark(object);
+    return object;
+}
+
+void heap_clear_marks() {
+    for (int i = 0; i <= SIZE_CLASS_COUNT; i++) {
+        for (HeapPage* page = size_classes[i].pages; page != NULL; page = page->next) {
+            memset(page->mark_bits, 0, sizeof(page->mark_bits));
+        }
+    }
+}
+
+void heap_begin_sweep() {
+    pages_to_sweep = 0;
+    sweep_class = 0;
+
+    for (int i = 0; i <= SIZE_CLASS_COUNT; i++) {
+        SizeClass* class_ = &size_classes[i];
+        class_->sweep_cursor = class_->pages;
+        for (HeapPage* page = class_->pages; page != NULL; page = page->next) {
+            page->needs_sweep = true;
+            pages_to_sweep += 1;
+        }
+    }
+}
+
+bool heap_is_sweeping() {
+    return pages_to_sweep > 0;
+}
+
+bool heap_sweep_pages(int count) {
+    while (count > 0 && sweep_class <= SIZE_CLASS_COUNT) {
+        SizeClass* class_ = &size_classes[sweep_class];
+        HeapPage* page = class_->sweep_cursor;
+        if (page == NULL) {
+            sweep_class += 1;
+            continue;
+        }
+
+        class_->sweep_cursor = page->next;
+        if (page->needs_sweep) {
+            sweep_page(page, true);
+            count -= 1;
+        }
+    }
+
+    return pages_to_sweep == 0;
+}
+
+/// @brief サイズクラスのページに入るセルの数
+/// @param size_class サイズクラスの番号
+/// @return セルの数
+static int cells_per_page(int size_class) {
+    return (int)((HEAP_PAGE_SIZE - HEAP_HEADER_SIZE) / cell_sizes[size_class]);
+}
+
+/// @brief ページが疎（使われているセルが少ない）かどうか
+/// @param page ページ
+/// @return 疎かどうか
+static bool is_sparse(HeapPage* page) {
+    return page->live_count * 100 < cells_per_page(page->size_class) * HEAP_SPARSE_PERCENT;
+}
+
+/// @brief サイズクラスの疎なページのオブジェクトを詰め直したときに空けられるページの数
+/// @param size_class サイズクラスの番号
+/// @return 空けられるページの数
+static int reclaimable_pages(int size_class) {
+    int sparse_pages = 0;
+    int sparse_live = 0;
+    for (HeapPage* page = size_classes[size_class].pages; page != NULL; page = page->next) {
+        if (is_sparse(page)) {
+            sparse_pages += 1;
+            sparse_live += page->live_count;
+        }
+    }
+
+    int per_page = cells_per_page(size_class);
+    return sparse_pages - (sparse_live + per_page - 1) / per_page;
+}
+
+bool heap_is_fragmented() {
+    int reclaimable = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        reclaimable += reclaimable_pages(i);
+    }
+    return reclaimable >= HEAP_COMPACT_MIN_PAGES;
+}
+
+/// @brief 選んだページを元に戻し，コンパクションを取りやめる
+static void cancel_evacuation() {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        SizeClass* class_ = &size_classes[i];
+        for (HeapPage* page = class_->pages; page != NULL; page = page->next) {
+            if (!page->evacuating) {
+                continue;
+            }
+
+            page->evacuating = false;
+            if (page->free_list != NULL && !page->is_available) {
+                add_available(class_, page);
+            }
+        }
+    }
+}
+
+/// @brief 選んだページのオブジェクトを全て移せるだけの空きセルを確保する．
+/// 移動先は空きセルのあるページから順に割り当てるので，足りない分だけ新しいページを加える
+/// @param size_class サイズクラスの番号
+/// @return 確保できたかどうか
+static bool reserve_evacuation_targets(int size_class) {
+    SizeClass* class_ = &size_classes[size_class];
+    int per_page = cells_per_page(size_class);
+
+    int needed = 0;
+    for (HeapPage* page = class_->pages; page != NULL; page = page->next) {
+        if (page->evacuating) {
+            needed += page->live_count;
+        }
+    }
+    if (needed == 0) {
+        return true;
+    }
+
+    // 割り当てに使うページと空きセルのあるページの空きは，新しいページより先に使われる
+    int free_cells = 0;
+    if (class_->current != NULL) {
+        free_cells += per_page - class_->current->live_count;
+    }
+    for (HeapPage* page = class_->available; page != NULL; page = page->next_available) {
+        free_cells += per_page - page->live_count;
+    }
+
+    while (free_cells < needed) {
+        HeapPage* page = new_page(size_class);
+        if (page == NULL) {
+            return false;
+        }
+        add_available(class_, page);
+        free_cells += per_page;
+    }
+    return true;
+}
+
+int heap_begin_evacuation(bool force) {
+    int count = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (!force && reclaimable_pages(i) < 1) {
+            continue;
+        }
+
+        SizeClass* class_ = &size_classes[i];
+        for (HeapPage* page = class_->pages; page != NULL; page = page->next) {
+            if (!is_sparse(page)) {
+                continue;
+            }
+
+            page->evacuating = true;
+            if (page->is_available) {
+                remove_available(class_, page);
+            }
+            if (class_->current == page) {
+                class_->current = NULL;
+            }
+            count += 1;
+        }
+    }
+
+    // 移動の途中で割り当てに失敗しないように，移動先を先に確保する．
+    // 確保できなければ今回は移さない（オブジェクトはそのままでも正しい）
+    for (int i = 0; i < SIZE_CLASS_COUNT && count > 0; i++) {
+        if (!reserve_evacuation_targets(i)) {
+            cancel_evacuation();
+            return 0;
+        }
+    }
+    return count;
+}
+
+void heap_evacuate() {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        // 移動先のページは連結リストの先頭に加わるので，選んだページだけを順にたどれる
+        for (HeapPage* page = size_classes[i].pages; page != NULL; page = page->next) {
+            if (!page->evacuating) {
+                continue;
+            }
+
+            for (int j = 0; j < HEAP_BITMAP_WORDS; j++) {
+                uint64_t live = page->alloc_bits[j];
+                while (live != 0) {
+                    int bit = __builtin_ctzll(live);
+                    live &= live - 1;
+
+                    // 移動先のセルはheap_begin_evacuationで確保してあるので，割り当ては失敗しない
+                    Obj* from = (Obj*)((char*)page + ((size_t)j * 64 + bit) * HEAP_GRANULE);
+                    Obj* to = heap_allocate(page->cell_size);
+                    memcpy(to, from, page->cell_size);
+                    if (heap_is_marked(from)) {
+                        heap_set_mark(to);
+                    }
+                    *(Obj**)from = to;
+                }
+            }
+        }
+    }
+}
+
+void heap_end_evacuation() {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        HeapPage* page = size_classes[i].pages;
+        while (page != NULL) {
+            HeapPage* next = page->next;
+            if (page->evacuating) {
+                // オブジェクトは移動先に移ったので，free_objectは呼ばない
+                vm.bytes_allocated -= (size_t)page->live_count * page->cell_size;
+                release_page(page);
+            }
+            page = next;
+        }
+    }
+}
+
+void heap_for_each_object(void (*visit)(Obj* object)) {
+    for (int i = 0; i <= SIZE_CLASS_COUNT; i++) {
+        for (HeapPage* page = size_classes[i].pages; page != NULL; page = page->next) {
+            if (page->evacuating) {
+                continue;
+            }
+
+            for (int j = 0; j < HEAP_BITMAP_WORDS; j++) {
+                uint64_t live = page->alloc_bits[j];
+                while (live != 0) {
+                    int bit = __builtin_ctzll(live);
+                    live &= live - 1;
+                    visit((Obj*)((char*)page + ((size_t)j * 64 + bit) * HEAP_GRANULE));
+                }
+            }
+        }
+    }
+}
+
+void free_heap() {
+    for (int i = 0; i <= SIZE_CLASS_COUNT; i++) {
+        SizeClass* class_ = &size_classes[i];
+        HeapPage* page = class_->pages;
+        while (page != NULL) {
+            HeapPage* next = page->next;
+
+            for (int j = 0; j < HEAP_BITMAP_WORDS; j++) {
+                uint64_t live = page->alloc_bits[j];
+                while (live != 0) {
+                    int bit = __builtin_ctzll(live);
+                    live &= live - 1;
+                    free_object((Obj*)((char*)page + ((size_t)j * 64 + bit) * HEAP_GRANULE));
+                }
+            }
+
+            munmap(page, page->page_size);
+            page = next;
+        }
+
+        class_->pages = NULL;
+        class_->current = NULL;
+        class_->available = NULL;
+        class_->sweep_cursor = NULL;
+    }
+
+    while (empty_pages != NULL) {
+        HeapPage* next = empty_pages->next;
+        munmap(empty_pages, HEAP_PAGE_SIZE);
+        empty_pages = next;
+    }
+
+    pages_to_sweep = 0;
+}
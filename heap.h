@@ -0,0 +1,153 @@
+/*
+オブジェクトを置くページ単位のヒープ
+*/
+
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+
+// ページの大きさ．ページはこの大きさに揃えて確保するので，オブジェクトのアドレスからページを求められる
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+// ビットマップの1ビットが表すバイト数．オブジェクトはこの大きさに揃えて置く
+#define HEAP_GRANULE 8
+
+// ページのビットマップの要素数
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+
+/// @brief 同じ大きさのセルにオブジェクトを置くページ．
+/// 大きなオブジェクトは，それだけを置く大きなページに置く
+typedef struct HeapPage {
+    /// @brief 同じサイズクラスのページの双方向連結リスト
+    struct HeapPage* next;
+    struct HeapPage* prev;
+    /// @brief 空きセルのあるページの双方向連結リスト
+    struct HeapPage* next_available;
+    struct HeapPage* prev_available;
+    /// @brief 空きセルの連結リスト（空きセルの先頭に次の空きセルを書く）
+    void* free_list;
+    /// @brief セルの大きさ
+    size_t cell_size;
+    /// @brief ページの大きさ（大きなページではHEAP_PAGE_SIZEより大きい）
+    size_t page_size;
+    /// @brief サイズクラスの番号
+    int size_class;
+    /// @brief 使われているセルの数
+    int live_count;
+    /// @brief 空きセルのあるページの連結リストに入っているかどうか
+    bool is_available;
+    /// @brief GCの後，まだsweepしていないかどうか
+    bool needs_sweep;
+    /// @brief コンパクションでオブジェクトを移している最中かどうか．
+    /// 移したオブジェクトの先頭には，移動先へのポインタを書いておく
+    bool evacuating;
+    /// @brief オブジェクトが置かれているセルの先頭を表すビットマップ
+    uint64_t alloc_bits[HEAP_BITMAP_WORDS];
+    /// @brief GCのマークのビットマップ．
+    /// 生き残ったオブジェクトはマークがついたままになり，古い世代として扱われる
+    uint64_t mark_bits[HEAP_BITMAP_WORDS];
+} HeapPage;
+
+/// @brief オブジェクトが置かれているページを求める
+/// @param object オブジェクト
+/// @return ページ
+static inline HeapPage* page_of(Obj* object) {
+    return (HeapPage*)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+/// @brief オブジェクトのビットマップでの位置を求める
+/// @param object オブジェクト
+/// @return ビットの番号
+static inline size_t granule_of(Obj* object) {
+    return ((uintptr_t)object & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE;
+}
+
+/// @brief オブジェクトにマークがついているかどうか
+/// @param object 対象のオブジェクト
+/// @return マークがついているかどうか
+static inline bool heap_is_marked(Obj* object) {
+    size_t granule = granule_of(object);
+    uint64_t word = __atomic_load_n(&page_of(object)->mark_bits[granule / 64], __ATOMIC_RELAXED);
+    return (word >> (granule % 64)) & 1;
+}
+
+/// @brief オブジェクトにマークをつける．複数のスレッドから同時に呼び出してよい
+/// @param object 対象のオブジェクト
+/// @return 既にマークがついていたかどうか
+static inline bool heap_set_mark(Obj* object) {
+    size_t granule = granule_of(object);
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+    uint64_t old = __atomic_fetch_or(&page_of(object)->mark_bits[granule / 64], bit, __ATOMIC_RELAXED);
+    return (old & bit) != 0;
+}
+
+/// @brief オブジェクトのマークを外す
+/// @param object 対象のオブジェクト
+static inline void heap_clear_mark(Obj* object) {
+    size_t granule = granule_of(object);
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+    __atomic_fetch_and(&page_of(object)->mark_bits[granule / 64], ~bit, __ATOMIC_RELAXED);
+}
+
+/// @brief コンパクションで移されたオブジェクトの移動先を求める
+/// @param object オブジェクト（NULLでもよい）
+/// @return 移動先．移されていなければobjectそのもの
+static inline Obj* heap_forward(Obj* object) {
+    if (object != NULL && page_of(object)->evacuating) {
+        return *(Obj**)object;
+    }
+    return object;
+}
+
+/// @brief オブジェクトを置くセルを割り当てる．sweep中なら，足りない分をそのサイズクラスのページのsweepで補う．
+/// 割り当てたセルの大きさをvm.bytes_allocatedに加える
+/// @param size オブジェクトのバイト数
+/// @return セル．マークはついていない．OSからメモリを得られなければNULL
+Obj* heap_allocate(size_t size);
+
+/// @brief 全てのページのマークを外す
+void heap_clear_marks();
+
+/// @brief 全てのページをsweepが必要な状態にする．実際のsweepは割り当てやheap_sweep_pagesで少しずつ行う
+void heap_begin_sweep();
+
+/// @brief まだsweepしていないページがあるかどうか
+/// @return sweepが必要なページがあるかどうか
+bool heap_is_sweeping();
+
+/// @brief まだsweepしていないページを指定した数だけsweepする
+/// @param count sweepするページの数
+/// @return 全てのページのsweepが終わったかどうか
+bool heap_sweep_pages(int count);
+
+/// @brief 空きセルの多いページが散らばっていて，コンパクションで空けられるページが十分にあるかどうか．
+/// sweepを終えているときに呼び出す
+/// @return コンパクションをするべきかどうか
+bool heap_is_fragmented();
+
+/// @brief コンパクションで空にするページを選び，それ以降の割り当てに使わないようにする．
+/// 移動先のセルもここで確保する
+/// @param force 空けられるページが少なくても，疎なページを全て選ぶかどうか
+/// @return 選んだページの数．移動先を確保できなければ何も選ばずに0
+int heap_begin_evacuation(bool force);
+
+/// @brief 選んだページのオブジェクトを他のページに移し，移動先へのポインタを残す．
+/// マークの有無（古い世代かどうか）は引き継ぐ
+void heap_evacuate();
+
+/// @brief 選んだページをOSに返す．オブジェクトへの参照を全て移動先に書き換えた後で呼び出す
+void heap_end_evacuation();
+
+/// @brief 生きている全てのオブジェクトを訪れる．sweepを終えているときに呼び出す．
+/// コンパクションで空にするページのオブジェクトは訪れない
+/// @param visit 訪れたオブジェクトを受け取る関数
+void heap_for_each_object(void (*visit)(Obj* object));
+
+/// @brief 全てのページを解放する．置かれているオブジェクトはfree_objectで解放する
+void free_heap();
+
+#endif
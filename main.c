@@ -5,6 +5,8 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "gcstats.h"
+#include "memory.h"
 #include "vm.h"
 
 static void repl() {
@@ -69,16 +71,173 @@ static void run_file(const char* path) {
     }
 }
 
+/// @brief 使い方を表示して終了する
+static void usage() {
+    fprintf(stderr, "Usage: clox [options] [path]\n");
+    fprintf(stderr, "  --gc-incremental     run the full GC incrementally\n");
+    fprintf(stderr, "  --gc-slice=<usec>    time budget for one incremental GC step\n");
+    fprintf(stderr, "  --gc-concurrent      mark the heap on a background thread\n");
+    fprintf(stderr, "  --gc-threads=<n>     mark the heap with n threads in full collections\n");
+    fprintf(stderr, "  --gc-compact         compact fragmented pages after full collections\n");
+    fprintf(stderr, "  --max-heap=<size>    raise a runtime error when the heap would exceed size\n");
+    fprintf(stderr, "  --gc-initial=<size>  heap size that triggers the first full collection,\n");
+    fprintf(stderr, "                       and the lowest threshold for later ones\n");
+    fprintf(stderr, "  --gc-growth=<factor> next full collection at factor times the surviving heap\n");
+    fprintf(stderr, "                       (turns off the pacer)\n");
+    fprintf(stderr, "  --gc-cpu=<percent>   pace full collections to use this share of CPU time\n");
+    fprintf(stderr, "                       (default 5, 0 keeps the growth factor fixed)\n");
+    fprintf(stderr, "  --gc-stats=json      print GC and allocation statistics to stderr at exit\n");
+    fprintf(stderr, "Sizes accept a K, M or G suffix. CLOX_MAX_HEAP, CLOX_GC_INITIAL,\n");
+    fprintf(stderr, "CLOX_GC_GROWTH and CLOX_GC_CPU set the same values; options override them.\n");
+    exit(64);
+}
+
+/// @brief バイト数を解析する．K，M，Gの接尾辞を受け付ける
+/// @param text 文字列
+/// @param size 解析したバイト数を書き込む先
+/// @return 解析できたかどうか
+static bool parse_size(const char* text, size_t* size) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return false;
+    }
+
+    switch (*end) {
+        case 'K': case 'k': value *= 1024; end++; break;
+        case 'M': case 'm': value *= 1024 * 1024; end++; break;
+        case 'G': case 'g': value *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0' || value > (double)SIZE_MAX) {
+        return false;
+    }
+
+    *size = (size_t)value;
+    return true;
+}
+
+/// @brief ヒープの大きさに関する設定をVMに適用する
+/// @param name 設定の名前（"max-heap"，"gc-initial"，"gc-growth"，"gc-cpu"）
+/// @param value 設定の値
+/// @return 値が正しいかどうか
+static bool apply_heap_setting(const char* name, const char* value) {
+    if (strcmp(name, "max-heap") == 0) {
+        return parse_size(value, &vm.max_heap);
+    }
+    if (strcmp(name, "gc-initial") == 0) {
+        if (!parse_size(value, &vm.gc_min_heap) || vm.gc_min_heap == 0) {
+            return false;
+        }
+        vm.next_gc = vm.gc_min_heap;
+        return true;
+    }
+    if (strcmp(name, "gc-growth") == 0) {
+        char* end;
+        double growth = strtod(value, &end);
+        if (end == value || *end != '\0' || !(growth > 1)) {
+            return false;
+        }
+        vm.gc_growth = growth;
+        vm.gc_cpu_target = 0;
+        return true;
+    }
+    if (strcmp(name, "gc-cpu") == 0) {
+        char* end;
+        double percent = strtod(value, &end);
+        if (end == value || *end != '\0' || !(percent >= 0 && percent < 100)) {
+            return false;
+        }
+        vm.gc_cpu_target = percent / 100;
+        return true;
+    }
+    return false;
+}
+
+/// @brief 終了時にGCと割り当ての統計をJSONで書き出す
+static void print_gc_stats_at_exit() {
+    print_gc_stats_json(stderr);
+}
+
+/// @brief 環境変数からヒープの大きさに関する設定を読む
+static void read_environment() {
+    static const char* const variables[][2] = {
+        {"CLOX_MAX_HEAP", "max-heap"},
+        {"CLOX_GC_INITIAL", "gc-initial"},
+        {"CLOX_GC_GROWTH", "gc-growth"},
+        {"CLOX_GC_CPU", "gc-cpu"},
+    };
+
+    for (size_t i = 0; i < sizeof(variables) / sizeof(variables[0]); i++) {
+        const char* value = getenv(variables[i][0]);
+        if (value != NULL && !apply_heap_setting(variables[i][1], value)) {
+            fprintf(stderr, "Invalid value for %s: '%s'\n", variables[i][0], value);
+            exit(64);
+        }
+    }
+}
+
+/// @brief オプションを解析してVMに設定する
+/// @param arg オプション
+static void parse_option(const char* arg) {
+    if (strcmp(arg, "--gc-incremental") == 0) {
+        vm.gc_incremental = true;
+    } else if (strcmp(arg, "--gc-concurrent") == 0) {
+        vm.gc_concurrent = true;
+    } else if (strcmp(arg, "--gc-compact") == 0) {
+        vm.gc_compact = true;
+    } else if (strncmp(arg, "--gc-threads=", 13) == 0) {
+        char* end;
+        long threads = strtol(arg + 13, &end, 10);
+        if (end == arg + 13 || *end != '\0' || threads < 1 || threads > GC_THREADS_MAX) {
+            usage();
+        }
+        vm.gc_threads = (int)threads;
+    } else if (strncmp(arg, "--gc-slice=", 11) == 0) {
+        char* end;
+        double usec = strtod(arg + 11, &end);
+        if (end == arg + 11 || *end != '\0' || usec <= 0) {
+            usage();
+        }
+        vm.gc_slice_budget = (uint64_t)(usec * 1000);
+    } else if (strcmp(arg, "--gc-stats=json") == 0) {
+        // run_fileはエラーのときにexitで終了するので，atexitで書き出す
+        atexit(print_gc_stats_at_exit);
+    } else if (strncmp(arg, "--max-heap=", 11) == 0
+            || strncmp(arg, "--gc-initial=", 13) == 0
+            || strncmp(arg, "--gc-growth=", 12) == 0
+            || strncmp(arg, "--gc-cpu=", 9) == 0) {
+        const char* equals = strchr(arg, '=');
+        char name[16];
+        size_t length = (size_t)(equals - arg - 2);
+        memcpy(name, arg + 2, length);
+        name[length] = '\0';
+        if (!apply_heap_setting(name, equals + 1)) {
+            usage();
+        }
+    } else {
+        usage();
+    }
+}
+
 int main(int argc, char const *argv[]) {
     init_vm();
+    read_environment();
+
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            parse_option(argv[i]);
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
 
-    if (argc == 1) {
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        run_file(path);
     }
 
     free_vm();
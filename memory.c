@@ -1,8 +1,16 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "gcstats.h"
+#include "heap.h"
 #include "memory.h"
+#include "pool.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -10,41 +18,482 @@
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// 割り当てがこの倍数だけ閾値を超えたら，インクリメンタルGCや並行GCの残りを一度に終わらせる
+#define GC_OVERRUN_FACTOR 2
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size) {
-    vm.bytes_allocated += new_size - old_size;
+// マークするスレッドがgc_lockを1回取るあいだにたどるオブジェクトの数
+#define GC_MARKER_BATCH 64
+
+// sweepの時間を確かめるまでにsweepするページの数
+#define GC_SWEEP_BATCH 8
+
+// 並列マークで1回に盗むオブジェクトの最大数
+#define GC_STEAL_MAX 256
+
+/// @brief 並列マークでスレッドごとに持つ灰色のオブジェクトの両端キュー．
+/// 持ち主は末尾から取り出し，他のスレッドは先頭から盗む
+typedef struct {
+    pthread_mutex_t lock;
+    /// @brief 盗まれていない最初の要素の位置
+    int head;
+    /// @brief 末尾の位置
+    int count;
+    /// @brief 容量
+    int capacity;
+    /// @brief 灰色のオブジェクト
+    Obj** items;
+} GrayDeque;
+
+/// @brief 並列マークのスレッドごとの両端キュー
+static GrayDeque gray_deques[GC_THREADS_MAX];
+
+/// @brief gray_dequesのうち初期化したものの数
+static int gray_deque_count = 0;
+
+/// @brief 並列マークで使う両端キューの数
+static int parallel_deques;
+
+/// @brief 並列マークに参加しているスレッドの数
+static int parallel_workers;
+
+/// @brief 並列マークで仕事がなくなったスレッドの数
+static int idle_workers;
+
+/// @brief 並列マーク中に，このスレッドが灰色のオブジェクトを積む両端キュー．並列マーク中でなければNULL
+static __thread GrayDeque* current_deque = NULL;
+
+/// @brief 並列マークを手伝うスレッド．最初の並列マークで作り，次の並列マークまで条件変数で待たせておく
+static pthread_t marker_workers[GC_THREADS_MAX];
+
+/// @brief 作った手伝いのスレッドの数
+static int marker_worker_count = 0;
+
+/// @brief 手伝いのスレッドを起こし，終わりを待つための排他
+static pthread_mutex_t marker_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief 手伝いのスレッドに並列マークの始まりを知らせる
+static pthread_cond_t marker_pool_wake = PTHREAD_COND_INITIALIZER;
+
+/// @brief 手伝いのスレッドが全て並列マークを終えたことを知らせる
+static pthread_cond_t marker_pool_done = PTHREAD_COND_INITIALIZER;
+
+/// @brief 並列マークを始めるたびに増やす番号．手伝いのスレッドは前に見た番号から変わると参加する
+static uint64_t marker_generation = 0;
+
+/// @brief 手伝いのスレッドを作ったときのmarker_generation
+static uint64_t marker_pool_generation = 0;
+
+/// @brief 今の並列マークを終えた手伝いのスレッドの数
+static int marker_finished = 0;
+
+/// @brief 手伝いのスレッドを終了させるかどうか
+static bool marker_pool_stopping = false;
+
+/// @brief GCが使うバッファ（灰色のスタックや記憶集合など）に割り当てたバイト数．ヒープの上限に含める
+static size_t gc_buffer_bytes = 0;
+
+/// @brief 灰色のスタックや両端キューがあふれて，マークをつけたまま積めなかったオブジェクトがあるかどうか．
+/// マークを終える前に，マークのついたオブジェクトをたどり直す
+static bool gray_overflowed = false;
+
+/// @brief 記憶集合を広げられず，古いオブジェクトを記録しそこねたかどうか．次の若い世代のGCを全世代のGCにする
+static bool remembered_overflowed = false;
+
+/// @brief 若い文字列のリストを広げられず，文字列を記録しそこねたかどうか．
+/// 次の若い世代のGCでは文字列の表全体から白色の文字列を取り除く
+static bool young_strings_overflowed = false;
+
+#ifdef DEBUG_STRESS_GC
+/// @brief ストレステストで次に全世代のGCを行うかどうか
+static bool stress_full_gc = false;
+#endif
+
+/// @brief sweep中のGCが全世代のGCかどうか
+static bool sweeping_full_gc = false;
+
+// sweep中に割り当てたバイト数（セルと配列の両方）．次のGCの閾値はこれを除いた生き残りの量から決める
+static size_t sweep_allocated = 0;
 
+/// @brief 全世代のGCの途中かどうか．このあいだの停止時間を全世代のGCの時間として数える
+static bool full_gc_running = false;
+
+/// @brief 今の全世代のGCの停止時間の合計（ナノ秒）
+static uint64_t full_gc_time = 0;
+
+/// @brief 今の全世代のGCを始めたときのvm.bytes_allocated
+static size_t full_gc_trigger = 0;
+
+/// @brief 前の全世代のGCで生き残ったバイト数
+static size_t last_survived = 0;
+
+/// @brief 前の全世代のGCが終わったときの，VMのスレッドのCPU時間（ナノ秒）
+static uint64_t last_full_gc_end = 0;
+
+static void gc_step();
+
+/// @brief 割り当てたバイト数が閾値を超えていれば，GCを行うか進める
+static void collect_if_needed() {
+    #ifdef DEBUG_STRESS_GC
+    if (vm.gc_phase != GC_IDLE) {
+        // インクリメンタルGCやsweepを割り当てのたびに進める
+        gc_step();
+    } else {
+        // 若い世代のGCと全世代のGCを交互に行う
+        stress_full_gc = !stress_full_gc;
+        if (stress_full_gc) {
+            collect_garbage();
+        } else {
+            collect_young_garbage();
+        }
+    }
+    #endif
+
+    if (vm.gc_phase != GC_IDLE) {
+        if (vm.bytes_allocated > vm.next_gc_step) {
+            gc_step();
+        }
+    } else if (vm.bytes_allocated > vm.next_gc) {
+        collect_garbage();
+    } else if (vm.bytes_allocated > vm.next_minor_gc) {
+        collect_young_garbage();
+    }
+}
+
+void ensure_heap_room(size_t size) {
+    if (vm.max_heap == 0 || vm.bytes_allocated + gc_buffer_bytes + size <= vm.max_heap) {
+        return;
+    }
+
+    // オブジェクトの書き換えの途中ではGCを始められないので，上限を少し超えるのを許す
+    if (vm.heap_writing) {
+        return;
+    }
+
+    collect_garbage();
+    finish_gc_cycle();
+    if (vm.bytes_allocated + gc_buffer_bytes + size > vm.max_heap) {
+        raise_out_of_memory();
+    }
+}
+
+/// @brief OSからメモリを得られなかったときに，全世代のGCでごみを返せるようにする
+/// @return やり直す価値があるかどうか
+static bool collect_for_retry() {
+    if (vm.heap_writing) {
+        return false;
+    }
+
+    collect_garbage();
+    finish_gc_cycle();
+    return true;
+}
+
+/// @brief メモリの再割り当てを，アロケータに頼む
+/// @param pointer 
+/// @param old_size 
+/// @param new_size 0より大きいこと
+/// @return 割り当てたメモリ．得られなければNULL
+static void* raw_reallocate(void* pointer, size_t old_size, size_t new_size) {
+    #ifdef POOL_ALLOCATOR
+    return pool_reallocate(pointer, old_size, new_size);
+    #else
+    return realloc(pointer, new_size);
+    #endif
+}
+
+void* reallocate(void* pointer, size_t old_size, size_t new_size) {
     // サイズの縮小時にはGCを呼び出さない
+    // （sweep中の解放からGCが再帰的に呼ばれないようにするため）
+    // オブジェクトの書き換えの途中（begin_heap_writeからend_heap_writeまで）も呼び出さない
+    bool may_collect = new_size > old_size && !vm.heap_writing;
+    if (may_collect) {
+        ensure_heap_room(new_size - old_size);
+    }
+
+    vm.bytes_allocated += new_size - old_size;
     if (new_size > old_size) {
-        #ifdef DEBUG_STRESS_GC
-        collect_garbage();
-        #endif
+        gc_stats.array_bytes_allocated += new_size - old_size;
+        update_peak_heap(vm.bytes_allocated);
+        if (vm.gc_phase == GC_SWEEP) {
+            sweep_allocated += new_size - old_size;
+        }
+    } else {
+        gc_stats.array_bytes_freed += old_size - new_size;
     }
 
-    if (vm.bytes_allocated > vm.next_gc) {
-        collect_garbage();
+    if (may_collect) {
+        collect_if_needed();
     }
 
     if (new_size == 0) {
+        #ifdef POOL_ALLOCATOR
+        pool_free(pointer, old_size);
+        #else
         free(pointer);
+        #endif
         return NULL;
     }
 
-    void * result = realloc(pointer, new_size);
+    void* result = raw_reallocate(pointer, old_size, new_size);
+    if (result == NULL && collect_for_retry()) {
+        result = raw_reallocate(pointer, old_size, new_size);
+    }
     if (result == NULL) {
-        fprintf(stderr, "realloc error\n");
-        exit(1);
+        vm.bytes_allocated -= new_size - old_size;
+        gc_stats.array_bytes_allocated -= new_size - old_size;
+        raise_out_of_memory();
     }
     return result;
 }
 
+Obj* allocate_cell(size_t size) {
+    if (!vm.heap_writing) {
+        ensure_heap_room(size);
+        collect_if_needed();
+    }
+
+    Obj* object = heap_allocate(size);
+    if (object == NULL && collect_for_retry()) {
+        object = heap_allocate(size);
+    }
+    if (object == NULL) {
+        raise_out_of_memory();
+    }
+
+    if (vm.gc_phase == GC_SWEEP) {
+        sweep_allocated += page_of(object)->cell_size;
+    }
+    update_peak_heap(vm.bytes_allocated);
+    return object;
+}
+
+/// @brief 現在の時刻を得る
+/// @return 単調増加する時刻（ナノ秒）
+static uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/// @brief VMのスレッドが使ったCPU時間を得る
+/// @return CPU時間（ナノ秒）
+static uint64_t thread_cpu_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/// @brief GCによる停止時間を記録する
+/// @param start 停止を始めた時刻（ナノ秒）
+static void record_pause(uint64_t start) {
+    uint64_t pause = now_ns() - start;
+    if (pause > vm.gc_max_pause) {
+        vm.gc_max_pause = pause;
+    }
+    count_pause(pause);
+    if (full_gc_running) {
+        full_gc_time += pause;
+    }
+}
+
+/// @brief 全世代のGCの後に，次の全世代のGCの閾値を決める．
+/// ペーサーを使うときは，前のGCからのヒープの増え方と今回のGCの時間から，
+/// 次のGCの時間がその間のミューテータの時間に対して目標の割合になる倍率を求める
+/// @param survived 生き残ったバイト数
+static void pace_next_gc(size_t survived) {
+    uint64_t now = thread_cpu_ns();
+    if (vm.gc_cpu_target > 0 && survived > 0 && now > last_full_gc_end + full_gc_time) {
+        double mutator_time = (double)(now - last_full_gc_end - full_gc_time);
+        size_t grown = full_gc_trigger > last_survived ? full_gc_trigger - last_survived : 0;
+        double growth_rate = (double)grown / mutator_time;
+
+        // 次のGCも今回と同じ時間がかかるとして，その間に増えるバイト数を閾値の余裕にする
+        double target = vm.gc_cpu_target;
+        double headroom = growth_rate * (double)full_gc_time * (1 - target) / target;
+        double growth = 1 + headroom / (double)survived;
+        if (growth < GC_PACER_MIN_GROWTH) {
+            growth = GC_PACER_MIN_GROWTH;
+        } else if (growth > GC_PACER_MAX_GROWTH) {
+            growth = GC_PACER_MAX_GROWTH;
+        }
+
+        // 1回の計測のぶれで閾値が大きく揺れないように，前の倍率と平均する
+        vm.gc_growth = (vm.gc_growth + growth) / 2;
+    }
+
+    last_full_gc_end = now;
+    last_survived = survived;
+
+    vm.next_gc = (size_t)(survived * vm.gc_growth);
+    if (vm.next_gc < vm.gc_min_heap) {
+        // 生きたデータが小さいうちは，全世代のGCを頻繁に繰り返さない
+        vm.next_gc = vm.gc_min_heap;
+    }
+    if (vm.max_heap != 0 && vm.next_gc > vm.max_heap) {
+        vm.next_gc = vm.max_heap;
+    }
+}
+
+/// @brief GCが使うバッファを，少なくともneeded個の要素が入るように広げる．広げた分はヒープの上限に含める
+/// @param buffer バッファ（ポインタの配列）を指す変数
+/// @param capacity バッファの容量を指す変数
+/// @param needed 必要な要素の数
+/// @return 足りる容量があるかどうか．ヒープの上限を超えるか，メモリを得られなければfalse
+static bool grow_gc_buffer(void** buffer, int* capacity, int needed) {
+    if (*capacity >= needed) {
+        return true;
+    }
+
+    int new_capacity = *capacity;
+    while (new_capacity < needed) {
+        new_capacity = GROW_CAPACITY(new_capacity);
+    }
+    size_t growth = sizeof(void*) * (size_t)(new_capacity - *capacity);
+    if (vm.max_heap != 0 && vm.bytes_allocated + gc_buffer_bytes + growth > vm.max_heap) {
+        return false;
+    }
+
+    void* grown = realloc(*buffer, sizeof(void*) * (size_t)new_capacity);
+    if (grown == NULL) {
+        return false;
+    }
+    *buffer = grown;
+    *capacity = new_capacity;
+    gc_buffer_bytes += growth;
+    return true;
+}
+
+/// @brief GCの途中でバッファを広げずに済むように，灰色のスタックにヒープの全てのオブジェクトが入る容量を確保する．
+/// 確保できなくてもGCは続けられる（あふれたら，マークのついたオブジェクトをたどり直す）
+static void reserve_gray_stack() {
+    grow_gc_buffer((void**)&vm.gray_stack, &vm.gray_capacity, (int)heap_object_count() + 1);
+}
+
+/// @brief オブジェクトをグレイスタックに積む．あふれたら，マークをつけたまま積まずにおく
+/// @param object 灰色にするオブジェクト
+static void push_gray(Obj* object) {
+    if (vm.gray_capacity < vm.gray_count + 1) {
+        // 並行マーク中はマークするスレッドが積むので，バッファを広げない
+        if (
+            vm.gc_phase == GC_CONCURRENT_MARK
+            || !grow_gc_buffer((void**)&vm.gray_stack, &vm.gray_capacity, vm.gray_count + 1)
+        ) {
+            gray_overflowed = true;
+            return;
+        }
+    }
+
+    vm.gray_stack[vm.gray_count] = object;
+    vm.gray_count += 1;
+}
+
+/// @brief 両端キューの末尾に積む．並列マーク中は広げず，あふれたらマークをつけたまま積まずにおく
+/// @param deque 両端キュー
+/// @param object 灰色のオブジェクト
+static void deque_push(GrayDeque* deque, Obj* object) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->head == deque->count) {
+        deque->head = 0;
+        deque->count = 0;
+    }
+
+    if (deque->count == deque->capacity && deque->head > 0) {
+        // 盗まれて空いた先頭を詰める
+        memmove(deque->items, deque->items + deque->head, sizeof(Obj*) * (size_t)(deque->count - deque->head));
+        deque->count -= deque->head;
+        deque->head = 0;
+    }
+
+    if (deque->count == deque->capacity) {
+        __atomic_store_n(&gray_overflowed, true, __ATOMIC_RELAXED);
+    } else {
+        deque->items[deque->count] = object;
+        deque->count += 1;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/// @brief 両端キューの末尾から取り出す
+/// @param deque 両端キュー
+/// @return 灰色のオブジェクト．空ならNULL
+static Obj* deque_pop(GrayDeque* deque) {
+    Obj* object = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > deque->head) {
+        deque->count -= 1;
+        object = deque->items[deque->count];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return object;
+}
+
+/// @brief 他のスレッドの両端キューの先頭から半分を盗んで，自分の両端キューに積む
+/// @param self 自分の両端キュー
+/// @return 盗めたかどうか
+static bool deque_steal(GrayDeque* self) {
+    Obj* stolen[GC_STEAL_MAX];
+    int self_index = (int)(self - gray_deques);
+
+    for (int i = 1; i < parallel_deques; i++) {
+        GrayDeque* victim = &gray_deques[(self_index + i) % parallel_deques];
+
+        pthread_mutex_lock(&victim->lock);
+        int count = (victim->count - victim->head + 1) / 2;
+        if (count > GC_STEAL_MAX) {
+            count = GC_STEAL_MAX;
+        }
+        for (int j = 0; j < count; j++) {
+            stolen[j] = victim->items[victim->head + j];
+        }
+        victim->head += count;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (count > 0) {
+            for (int j = 0; j < count; j++) {
+                deque_push(self, stolen[j]);
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// @brief いずれかの両端キューに灰色のオブジェクトがあるかどうか
+/// @return 灰色のオブジェクトがあるかどうか
+static bool any_gray_in_deques() {
+    for (int i = 0; i < parallel_deques; i++) {
+        GrayDeque* deque = &gray_deques[i];
+        pthread_mutex_lock(&deque->lock);
+        bool found = deque->count > deque->head;
+        pthread_mutex_unlock(&deque->lock);
+
+        if (found) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void mark_object(Obj* object) {
     if (object == NULL) {
         return;
     }
 
-    if (object->is_marked) {
+    if (current_deque != NULL) {
+        // 並列マーク中は，他のスレッドと同時にマークをつけようとしても1つだけが成功する
+        if (!heap_set_mark(object)) {
+            deque_push(current_deque, object);
+        }
+        return;
+    }
+
+    if (is_marked(object)) {
         return;
     }
 
@@ -54,20 +503,77 @@ void mark_object(Obj* object) {
     printf("\n");
     #endif
 
-    object->is_marked = true;
+    heap_set_mark(object);
+    push_gray(object);
+}
 
-    if (vm.gray_capacity < vm.gray_count + 1) {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+void track_young_string(ObjString* string) {
+    if (!grow_gc_buffer((void**)&vm.young_strings, &vm.young_string_capacity, vm.young_string_count + 1)) {
+        // 文字列は表に入っているので，次の若い世代のGCで表全体から探せるようにしておく
+        young_strings_overflowed = true;
+        raise_out_of_memory();
+    }
 
-        if (vm.gray_stack == NULL) {
-            printf("allocation failed.");
-            exit(1);
-        }
+    vm.young_strings[vm.young_string_count++] = string;
+}
+
+void remember_object(Obj* object) {
+    if (object->is_remembered) {
+        return;
     }
 
-    vm.gray_stack[vm.gray_count] = object;
-    vm.gray_count += 1;
+    #ifdef DEBUG_LOG_GC
+    printf("%p remember ", (void*)object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+    #endif
+
+    if (!grow_gc_buffer((void**)&vm.remembered, &vm.remembered_capacity, vm.remembered_count + 1)) {
+        // 古いオブジェクトからの参照を記録できないので，次の若い世代のGCは全世代をたどる
+        remembered_overflowed = true;
+        raise_out_of_memory();
+    }
+
+    object->is_remembered = true;
+    vm.remembered[vm.remembered_count] = object;
+    vm.remembered_count += 1;
+}
+
+void write_barrier_object(Obj* object) {
+    if (!is_marked(object) || vm.gc_phase == GC_CONCURRENT_MARK) {
+        return;
+    }
+
+    if (vm.gc_phase == GC_MARK) {
+        // もう一度たどり直す
+        push_gray(object);
+    } else {
+        remember_object(object);
+    }
+}
+
+void satb_log(Obj* object) {
+    // 上書きの前に呼ばれるので，ここで止めても参照は元のオブジェクトに残っている
+    if (!grow_gc_buffer((void**)&vm.satb_buffer, &vm.satb_capacity, vm.satb_count + 1)) {
+        raise_out_of_memory();
+    }
+
+    vm.satb_buffer[vm.satb_count] = object;
+    vm.satb_count += 1;
+}
+
+void track_new_object(Obj* object) {
+    // 新しいオブジェクトはマークがついておらず，若い世代に入る
+    if (vm.gc_phase == GC_CONCURRENT_MARK) {
+        // 並行マーク中に割り当てたオブジェクトは黒色にする．
+        // 中身はスナップショットから到達できるか，後で割り当てたものなので，たどらなくてよい
+        heap_set_mark(object);
+    } else if (vm.gc_phase == GC_MARK) {
+        // マーク中に割り当てたオブジェクトは灰色にする．
+        // フィールドは割り当ての直後に書き込まれるので，次にGCを進めるときにたどる
+        heap_set_mark(object);
+        push_gray(object);
+    }
 }
 
 void mark_value(Value value) {
@@ -104,6 +610,9 @@ static void blacken_object(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* class_ = (ObjClass*)object;
             mark_object((Obj*)class_->name);
+            for (int i = 0; i < class_->vtable_count; i++) {
+                mark_value(class_->vtable[i]);
+            }
             mark_table(&class_->methods);
             break;
         }
@@ -127,19 +636,32 @@ static void blacken_object(Obj* object) {
             mark_table(&instance->fields);
             break;
         }
+        case OBJ_LIST:
+            mark_array(&((ObjList*)object)->items);
+            break;
+        case OBJ_MAP:
+            mark_table(&((ObjMap*)object)->table);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            mark_object((Obj*)rope->flat);
+            mark_object(rope->left);
+            mark_object(rope->right);
+            break;
+        }
         case OBJ_UPVALUE:
             mark_value(((ObjUpvalue*)object)->closed);
             break;
+        case OBJ_FLOAT_ARRAY:
         case OBJ_NATIVE:
         case OBJ_STRING:
+        case OBJ_STRING_BUILDER:
             // フィールドを持たないのでこれ以上遡れない
             break;
     }
 }
 
-/// @brief Objを解放する
-/// @param object 解放されるObj
-static void free_object(Obj* object) {
+void free_object(Obj* object) {
     #ifdef DEBUG_LOG_GC
     // メモリ解放のログ
     printf("%p free type %d\n", (void*)object, object->type);
@@ -147,42 +669,45 @@ static void free_object(Obj* object) {
 
     switch (object->type) {
         case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
             break;
         case OBJ_CLASS: {
             ObjClass* class_ = (ObjClass*)object;
+            FREE_ARRAY(Value, class_->vtable, class_->vtable_count);
             free_table(&class_->methods);
-            FREE(ObjClass, object);
-            break;
-        }
-        case OBJ_CLOSURE: {
-            ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             free_chunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             free_table(&instance->fields);
-            FREE(ObjInstance, object);
             break;
         }
-        case OBJ_NATIVE:
-            FREE(ObjNative, object);
+        case OBJ_LIST:
+            free_value_array(&((ObjList*)object)->items);
             break;
-        case OBJ_STRING:
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_MAP:
+            free_table(&((ObjMap*)object)->table);
+            break;
+        case OBJ_FLOAT_ARRAY: {
+            ObjFloatArray* array = (ObjFloatArray*)object;
+            FREE_ARRAY(double, array->values, array->count);
             break;
+        }
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)object;
+            FREE_ARRAY(char, builder->chars, builder->capacity);
+            break;
+        }
+        case OBJ_CLOSURE:
+        case OBJ_NATIVE:
+        case OBJ_ROPE:
+        case OBJ_STRING:
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            // 上位値の配列や文字はオブジェクトと一緒にセルに置かれている
             break;
     }
 }
@@ -208,60 +733,520 @@ static void mark_roots() {
     }
 
     mark_table(&vm.globals);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        mark_table(&vm.native_methods[i]);
+    }
+    mark_table(&vm.selectors);
+    mark_array(&vm.selector_names);
     mark_compiler_roots();
     mark_object((Obj*)vm.init_string);
 }
 
-/// @brief 到達可能なオブジェクトを追跡する
+/// @brief 記憶集合にある古いオブジェクトから，若いオブジェクトへの参照をたどる
+static void mark_remembered() {
+    for (int i = 0; i < vm.remembered_count; i++) {
+        blacken_object(vm.remembered[i]);
+    }
+}
+
+/// @brief 記憶集合を空にする
+static void clear_remembered() {
+    for (int i = 0; i < vm.remembered_count; i++) {
+        vm.remembered[i]->is_remembered = false;
+    }
+    vm.remembered_count = 0;
+    remembered_overflowed = false;
+}
+
+/// @brief 灰色のスタックが空になるまでたどる
+static void drain_gray_stack() {
+    while (vm.gray_count > 0) {
+        vm.gray_count -= 1;
+        Obj* object = vm.gray_stack[vm.gray_count];
+        blacken_object(object);
+    }
+}
+
+/// @brief マークのついたオブジェクトをたどり直す．あふれて積めなかったオブジェクトの子にマークをつける
+/// @param object ヒープのオブジェクト
+static void rescan_marked(Obj* object) {
+    if (is_marked(object)) {
+        blacken_object(object);
+        drain_gray_stack();
+    }
+}
+
+/// @brief 到達可能なオブジェクトを追跡する．灰色のスタックがあふれていたら，
+/// あふれなくなるまでマークのついたオブジェクトをたどり直す
 static void trace_references() {
+    drain_gray_stack();
+    while (gray_overflowed) {
+        gray_overflowed = false;
+        heap_for_each_object(rescan_marked);
+    }
+}
+
+/// @brief 並列マークのスレッドの本体．自分の両端キューが空になったら他から盗み，
+/// 全てのスレッドの仕事がなくなったら終わる
+/// @param arg 自分の両端キュー
+/// @return NULL
+static void* parallel_marker_main(void* arg) {
+    GrayDeque* self = (GrayDeque*)arg;
+    current_deque = self;
+
+    for (;;) {
+        Obj* object;
+        while ((object = deque_pop(self)) != NULL) {
+            blacken_object(object);
+        }
+
+        if (deque_steal(self)) {
+            continue;
+        }
+
+        // 灰色のオブジェクトを積めるのは両端キューの持ち主だけなので，
+        // 全てのスレッドが仕事を失えば，全ての両端キューが空になっている
+        __atomic_add_fetch(&idle_workers, 1, __ATOMIC_ACQ_REL);
+        while (
+            __atomic_load_n(&idle_workers, __ATOMIC_ACQUIRE)
+                < __atomic_load_n(&parallel_workers, __ATOMIC_ACQUIRE)
+            && !any_gray_in_deques()
+        ) {
+            sched_yield();
+        }
+
+        if (
+            __atomic_load_n(&idle_workers, __ATOMIC_ACQUIRE)
+                >= __atomic_load_n(&parallel_workers, __ATOMIC_ACQUIRE)
+        ) {
+            break;
+        }
+        __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_ACQ_REL);
+    }
+
+    current_deque = NULL;
+    return NULL;
+}
+
+/// @brief 並列マークを手伝うスレッドの本体．並列マークが始まるまで条件変数で待ち，参加して終わったら知らせる
+/// @param arg 自分の両端キューの番号（1から）
+/// @return NULL
+static void* marker_worker_main(void* arg) {
+    GrayDeque* deque = &gray_deques[(intptr_t)arg];
+
+    pthread_mutex_lock(&marker_pool_lock);
+    uint64_t seen = marker_pool_generation;
+    for (;;) {
+        while (marker_generation == seen && !marker_pool_stopping) {
+            pthread_cond_wait(&marker_pool_wake, &marker_pool_lock);
+        }
+        if (marker_pool_stopping) {
+            break;
+        }
+        seen = marker_generation;
+        pthread_mutex_unlock(&marker_pool_lock);
+
+        parallel_marker_main(deque);
+
+        pthread_mutex_lock(&marker_pool_lock);
+        marker_finished += 1;
+        if (marker_finished == marker_worker_count) {
+            pthread_cond_signal(&marker_pool_done);
+        }
+    }
+    pthread_mutex_unlock(&marker_pool_lock);
+    return NULL;
+}
+
+/// @brief 並列マークを手伝うスレッドがまだなければ作る．作れなかった分は少ないスレッドで進める
+/// @param count 作るスレッドの数
+static void start_marker_pool(int count) {
+    if (marker_worker_count > 0) {
+        return;
+    }
+
+    marker_pool_generation = marker_generation;
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&marker_workers[i], NULL, marker_worker_main, (void*)(intptr_t)(i + 1)) != 0) {
+            break;
+        }
+        marker_worker_count += 1;
+    }
+}
+
+/// @brief 並列マークを手伝うスレッドを終了させる
+static void stop_marker_pool() {
+    pthread_mutex_lock(&marker_pool_lock);
+    marker_pool_stopping = true;
+    pthread_cond_broadcast(&marker_pool_wake);
+    pthread_mutex_unlock(&marker_pool_lock);
+
+    for (int i = 0; i < marker_worker_count; i++) {
+        pthread_join(marker_workers[i], NULL);
+    }
+    marker_worker_count = 0;
+    marker_pool_stopping = false;
+}
+
+/// @brief vm.gc_threads個のスレッドで到達可能なオブジェクトを追跡する
+static void trace_references_parallel() {
+    int thread_count = vm.gc_threads;
+
+    for (; gray_deque_count < thread_count; gray_deque_count++) {
+        GrayDeque* deque = &gray_deques[gray_deque_count];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->head = 0;
+        deque->count = 0;
+        deque->capacity = 0;
+        deque->items = NULL;
+    }
+
+    // 並列マーク中は両端キューを広げないので，先に確保しておく．
+    // 盗み合いで偏っても足りるように，均等に分けた量の2倍にする
+    int reserve = (int)(heap_object_count() * 2 / (uint64_t)thread_count) + GC_STEAL_MAX;
+    for (int i = 0; i < thread_count; i++) {
+        grow_gc_buffer((void**)&gray_deques[i].items, &gray_deques[i].capacity, reserve);
+    }
+
+    // ルートを各スレッドに配る
+    for (int i = 0; i < vm.gray_count; i++) {
+        deque_push(&gray_deques[i % thread_count], vm.gray_stack[i]);
+    }
+    vm.gray_count = 0;
+
+    start_marker_pool(thread_count - 1);
+
+    // 作れなかったスレッドの両端キューは，他のスレッドが盗んで空にする
+    parallel_deques = thread_count;
+    parallel_workers = 1 + marker_worker_count;
+    idle_workers = 0;
+
+    pthread_mutex_lock(&marker_pool_lock);
+    marker_finished = 0;
+    marker_generation += 1;
+    pthread_cond_broadcast(&marker_pool_wake);
+    pthread_mutex_unlock(&marker_pool_lock);
+
+    // このスレッドも参加する
+    parallel_marker_main(&gray_deques[0]);
+
+    // 次の並列マークで数を数え直す前に，全ての手伝いのスレッドがparallel_marker_mainから出るのを待つ
+    pthread_mutex_lock(&marker_pool_lock);
+    while (marker_finished < marker_worker_count) {
+        pthread_cond_wait(&marker_pool_done, &marker_pool_lock);
+    }
+    pthread_mutex_unlock(&marker_pool_lock);
+}
+
+/// @brief 全世代のGCで，到達可能なオブジェクトを追跡する．
+/// vm.gc_threadsが2以上なら並列に追跡する
+static void trace_heap() {
+    if (vm.gc_threads > 1) {
+        trace_references_parallel();
+    }
+    // 並列マークで両端キューがあふれていれば，ここでたどり直す
+    trace_references();
+}
+
+/// @brief 期限まで到達可能なオブジェクトを追跡する
+/// @param deadline 期限（ナノ秒）
+/// @return 灰色のオブジェクトがなくなったかどうか
+static bool trace_references_until(uint64_t deadline) {
+    int count = 0;
     while (vm.gray_count > 0) {
+        #ifdef DEBUG_STRESS_GC
+        // 1回に1つずつたどって，ミューテータとできるだけ細かく交互に実行する
+        if (count == 1) {
+            return false;
+        }
+        #else
+        // 時刻の取得は重いので，ときどき確認する
+        if (count % 64 == 63 && now_ns() >= deadline) {
+            return false;
+        }
+        #endif
+
         vm.gray_count -= 1;
         Obj* object = vm.gray_stack[vm.gray_count];
         blacken_object(object);
+        count += 1;
     }
+
+    return true;
 }
 
-/// @brief 白色（到達不可能）のオブジェクトを解放する．
-/// 灰色のオブジェクトが全てなくなり，追跡が完了した後に呼び出す．
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+/// @brief マークを終えたGCのsweepを始める．sweepは割り当てとgc_stepで少しずつ進める
+/// @param full 全世代のGCかどうか
+static void begin_sweep(bool full) {
+    heap_begin_sweep();
+    sweeping_full_gc = full;
+    sweep_allocated = 0;
+    vm.gc_phase = GC_SWEEP;
+    vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+}
 
-    // 全てのオブジェクトを巡回
-    while (object != NULL) {
-        if (object->is_marked) {
-            // 黒色なら何もしない
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            // 一方向連結リストからリンクを外して解放する
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                // 最初のノードを解放する
-                vm.objects = object;
-            }
+/// @brief sweepを終えて，次のGCの閾値を決める
+static void end_sweep() {
+    vm.gc_phase = GC_IDLE;
+    size_t survived = vm.bytes_allocated - sweep_allocated;
+    if (sweeping_full_gc) {
+        full_gc_running = false;
+        pace_next_gc(survived);
+    }
+    vm.next_minor_gc = survived + GC_NURSERY_SIZE;
+    snapshot_live_objects();
+
+    // 全世代のGCで生き残ったオブジェクトが散らばっていたら，次の安全点でコンパクションをする
+    if (vm.gc_compact && sweeping_full_gc) {
+        #ifdef DEBUG_STRESS_GC
+        vm.compact_requested = true;
+        #else
+        vm.compact_requested = heap_is_fragmented();
+        #endif
+    }
+}
+
+/// @brief 残りのsweepを一度に終わらせる
+static void finish_sweep() {
+    if (vm.gc_phase == GC_SWEEP) {
+        heap_sweep_pages(INT_MAX);
+        end_sweep();
+    }
+}
+
+/// @brief 前のGCの後にインターン化された文字列のうち，白色のものを文字列の表から削除する．
+/// 古い文字列はマークがついたままなので，表全体を調べなくてよい
+static void remove_white_young_strings() {
+    if (young_strings_overflowed) {
+        // 記録しそこねた文字列があるので，表全体を調べる
+        string_set_remove_white(&vm.strings);
+        vm.young_string_count = 0;
+        young_strings_overflowed = false;
+        return;
+    }
 
-            free_object(unreached);
+    for (int i = 0; i < vm.young_string_count; i++) {
+        ObjString* string = vm.young_strings[i];
+        if (!is_marked(&string->obj)) {
+            string_set_remove(&vm.strings, string);
         }
     }
+    vm.young_string_count = 0;
 }
 
-void collect_garbage() {
+/// @brief 全世代のGCで，インターン化された文字列の表全体から白色のものを削除する
+static void remove_white_strings() {
+    string_set_remove_white(&vm.strings);
+    vm.young_string_count = 0;
+    young_strings_overflowed = false;
+}
+
+void collect_young_garbage() {
     #ifdef DEBUG_LOG_GC
-    printf("--- gc begin\n");
+    printf("--- minor gc begin\n");
     size_t before = vm.bytes_allocated;
     #endif
 
+    // マーク中は若いオブジェクトも灰色や黒色で割り当てているので，若い世代だけを集められない
+    if (vm.gc_phase == GC_MARK || vm.gc_phase == GC_CONCURRENT_MARK) {
+        return;
+    }
+
+    // 記憶集合に漏れがあれば，古いオブジェクトからの参照をたどれないので全世代のGCにする
+    if (remembered_overflowed) {
+        collect_garbage();
+        return;
+    }
+
+    uint64_t start = now_ns();
+    gc_stats.minor_collections += 1;
+
+    // 前のGCでマークのつかなかったオブジェクトを先に解放する
+    finish_sweep();
+    reserve_gray_stack();
+
+    // 古いオブジェクトはマークがついたままなので，ルートからは若いオブジェクトだけがたどられる
     mark_roots();
+    mark_remembered();
     trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
+    remove_white_young_strings();
+    clear_remembered();
+    begin_sweep(false);
+
+    record_pause(start);
+
+    #ifdef DEBUG_LOG_GC
+    printf("--- minor gc end\n");
+    printf(
+        "   collected %zu bytes (from %zu to %zu) next at %zu\n",
+        before - vm.bytes_allocated,
+        before,
+        vm.bytes_allocated,
+        vm.next_minor_gc
+    );
+    #endif
+}
+
+/// @brief 全世代のGCを始める．全てのオブジェクトを白色に戻して，ルートにマークをつける
+static void begin_full_gc() {
+    heap_clear_marks();
+    clear_remembered();
+
+    mark_roots();
+}
+
+/// @brief 全世代のGCのマークを終える．ルートをたどり直してから，インターン化された文字列の表を掃除して，sweepを始める
+static void finish_mark() {
+    mark_roots();
+    trace_heap();
+    remove_white_strings();
+    begin_sweep(true);
+}
+
+/// @brief SATBバッファに記録されたオブジェクトを灰色にする．gc_lockを持っているときに呼び出す
+static void drain_satb() {
+    for (int i = 0; i < vm.satb_count; i++) {
+        mark_object(vm.satb_buffer[i]);
+    }
+    vm.satb_count = 0;
+}
+
+/// @brief 並行してマークするスレッドの本体．灰色のオブジェクトがなくなるまでたどる
+/// @param arg 使わない
+/// @return NULL
+static void* marker_main(void* arg) {
+    bool done = false;
+    while (!done) {
+        pthread_mutex_lock(&vm.gc_lock);
+
+        drain_satb();
+        for (int i = 0; i < GC_MARKER_BATCH && vm.gray_count > 0; i++) {
+            vm.gray_count -= 1;
+            Obj* object = vm.gray_stack[vm.gray_count];
+            blacken_object(object);
+        }
+        done = vm.gray_count == 0;
+
+        pthread_mutex_unlock(&vm.gc_lock);
+    }
+
+    __atomic_store_n(&vm.marker_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+/// @brief 並行マークを始める．ルートは既に灰色になっているものとする
+/// @return スレッドを作れたかどうか
+static bool start_concurrent_mark() {
+    vm.marker_done = false;
+    vm.gc_phase = GC_CONCURRENT_MARK;
+    if (pthread_create(&vm.marker_thread, NULL, marker_main, NULL) != 0) {
+        vm.gc_phase = GC_IDLE;
+        return false;
+    }
+    return true;
+}
+
+/// @brief 並行マークを終える（再マーク）．
+/// マークするスレッドを待ってから，SATBバッファに残ったオブジェクトをたどる
+static void finish_concurrent_mark() {
+    pthread_join(vm.marker_thread, NULL);
+
+    // スナップショットから到達できるものは全てたどったので，ルートをたどり直す必要はない
+    drain_satb();
+    trace_heap();
+    remove_white_strings();
+    begin_sweep(true);
+}
+
+/// @brief インクリメンタルGCを予算の範囲で1回進める
+static void gc_step() {
+    uint64_t start = now_ns();
+    uint64_t deadline = start + vm.gc_slice_budget;
+
+    if (vm.gc_phase == GC_CONCURRENT_MARK) {
+        // 割り当てにマークが追いつかないときは，マークするスレッドを待つ
+        bool overrun = vm.bytes_allocated > vm.next_gc * GC_OVERRUN_FACTOR;
+        if (overrun || __atomic_load_n(&vm.marker_done, __ATOMIC_ACQUIRE)) {
+            finish_concurrent_mark();
+        }
+    } else if (vm.gc_phase == GC_MARK) {
+        // 割り当てにマークが追いつかないときは，残りを一度に終わらせる
+        bool overrun = vm.bytes_allocated > vm.next_gc * GC_OVERRUN_FACTOR;
+        if (overrun) {
+            trace_heap();
+        }
+
+        if (overrun || trace_references_until(deadline)) {
+            finish_mark();
+        }
+    } else if (vm.gc_phase == GC_SWEEP) {
+        #ifdef DEBUG_STRESS_GC
+        // 1回に1ページずつsweepして，割り当てとできるだけ細かく交互に実行する
+        bool done = heap_sweep_pages(1);
+        #else
+        bool done = heap_sweep_pages(GC_SWEEP_BATCH);
+        while (!done && now_ns() < deadline) {
+            done = heap_sweep_pages(GC_SWEEP_BATCH);
+        }
+        #endif
+
+        if (done) {
+            end_sweep();
+        }
+    }
+
+    vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+    record_pause(start);
+}
+
+void finish_gc_cycle() {
+    if (vm.gc_phase == GC_CONCURRENT_MARK) {
+        finish_concurrent_mark();
+    }
+
+    if (vm.gc_phase == GC_MARK) {
+        trace_heap();
+        finish_mark();
+    }
+
+    finish_sweep();
+}
+
+void collect_garbage() {
+    #ifdef DEBUG_LOG_GC
+    printf("--- gc begin\n");
+    size_t before = vm.bytes_allocated;
+    #endif
+
+    uint64_t start = now_ns();
+
+    finish_gc_cycle();
+
+    gc_stats.full_collections += 1;
+    full_gc_running = true;
+    full_gc_time = 0;
+    full_gc_trigger = vm.bytes_allocated;
+    reserve_gray_stack();
+    begin_full_gc();
+    // コンパイル中の関数のチャンクはマークするスレッドと排他せずに書き換えるので，並行マークしない
+    if (vm.gc_concurrent && !is_compiling() && start_concurrent_mark()) {
+        // 残りはマークするスレッドに任せる
+        vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+        record_pause(start);
+        return;
+    }
+
+    if (vm.gc_incremental) {
+        // 残りは割り当てのたびに少しずつ進める
+        vm.gc_phase = GC_MARK;
+        vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+        record_pause(start);
+        return;
+    }
+
+    trace_heap();
+    finish_mark();
+    record_pause(start);
 
     #ifdef DEBUG_LOG_GC
     printf("--- gc end\n");
@@ -275,14 +1260,160 @@ void collect_garbage() {
     #endif
 }
 
-void free_objects() {
-    Obj* object = vm.objects;
+/// @brief オブジェクトへの参照を，移動先を指すように書き換える
+/// @param object 生きているオブジェクト
+static void forward_references(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            bound->receiver = forward_value(bound->receiver);
+            bound->method = (ObjClosure*)heap_forward((Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* class_ = (ObjClass*)object;
+            class_->name = (ObjString*)heap_forward((Obj*)class_->name);
+            for (int i = 0; i < class_->vtable_count; i++) {
+                class_->vtable[i] = forward_value(class_->vtable[i]);
+            }
+            forward_table(&class_->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            closure->function = (ObjFunction*)heap_forward((Obj*)closure->function);
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                closure->upvalues[i] = (ObjUpvalue*)heap_forward((Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            function->name = (ObjString*)heap_forward((Obj*)function->name);
+            ValueArray* constants = &function->chunk.constants;
+            for (int i = 0; i < constants->count; i++) {
+                constants->values[i] = forward_value(constants->values[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            instance->class_ = (ObjClass*)heap_forward((Obj*)instance->class_);
+            forward_table(&instance->fields);
+            break;
+        }
+        case OBJ_LIST: {
+            ValueArray* items = &((ObjList*)object)->items;
+            for (int i = 0; i < items->count; i++) {
+                items->values[i] = forward_value(items->values[i]);
+            }
+            break;
+        }
+        case OBJ_MAP:
+            forward_table(&((ObjMap*)object)->table);
+            break;
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            upvalue->closed = forward_value(upvalue->closed);
+            upvalue->next = (ObjUpvalue*)heap_forward((Obj*)upvalue->next);
+            // クローズした上位値は自分のclosedを指しているので，移したなら移動先のclosedを指し直す
+            if (upvalue->location < vm.stack || upvalue->location >= vm.stack + STACK_MAX) {
+                upvalue->location = &upvalue->closed;
+            }
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            rope->flat = (ObjString*)heap_forward((Obj*)rope->flat);
+            rope->left = heap_forward(rope->left);
+            rope->right = heap_forward(rope->right);
+            break;
+        }
+        case OBJ_FLOAT_ARRAY:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_STRING_BUILDER:
+            break;
+    }
+}
 
-    while (object != NULL) {
-        Obj* next = object->next;
-        free_object(object);
-        object = next;
+/// @brief ルートからの参照を，移動先を指すように書き換える
+static void forward_roots() {
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        *slot = forward_value(*slot);
     }
+    for (int i = 0; i < vm.frame_count; i++) {
+        vm.frames[i].closure = (ObjClosure*)heap_forward((Obj*)vm.frames[i].closure);
+    }
+    vm.open_upvalues = (ObjUpvalue*)heap_forward((Obj*)vm.open_upvalues);
+
+    forward_table(&vm.globals);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        forward_table(&vm.native_methods[i]);
+    }
+    forward_string_set(&vm.strings);
+    forward_table(&vm.selectors);
+    for (int i = 0; i < vm.selector_names.count; i++) {
+        vm.selector_names.values[i] = forward_value(vm.selector_names.values[i]);
+    }
+    vm.init_string = (ObjString*)heap_forward((Obj*)vm.init_string);
+
+    for (int i = 0; i < vm.remembered_count; i++) {
+        vm.remembered[i] = heap_forward(vm.remembered[i]);
+    }
+    for (int i = 0; i < vm.young_string_count; i++) {
+        vm.young_strings[i] = (ObjString*)heap_forward((Obj*)vm.young_strings[i]);
+    }
+}
+
+void compact_heap() {
+    // マークやsweepの途中では，マークビットや未sweepのページのオブジェクトを移せない
+    if (vm.gc_phase != GC_IDLE || is_compiling()) {
+        return;
+    }
+    vm.compact_requested = false;
+
+    uint64_t start = now_ns();
+
+    #ifdef DEBUG_STRESS_GC
+    int pages = heap_begin_evacuation(true);
+    #else
+    int pages = heap_begin_evacuation(false);
+    #endif
+    if (pages == 0) {
+        return;
+    }
+
+    #ifdef DEBUG_LOG_GC
+    printf("--- compact begin\n");
+    #endif
+
+    gc_stats.compactions += 1;
+    heap_evacuate();
+    forward_roots();
+    heap_for_each_object(forward_references);
+    heap_end_evacuation();
+    record_pause(start);
+
+    #ifdef DEBUG_LOG_GC
+    printf("--- compact end\n");
+    printf("   evacuated %d pages\n", pages);
+    #endif
+}
+
+void free_objects() {
+    stop_marker_pool();
+    free_heap();
 
     free(vm.gray_stack);
-}
\ No newline at end of file
+    free(vm.remembered);
+    free(vm.young_strings);
+    free(vm.satb_buffer);
+    gc_buffer_bytes = 0;
+
+    for (int i = 0; i < gray_deque_count; i++) {
+        pthread_mutex_destroy(&gray_deques[i].lock);
+        free(gray_deques[i].items);
+    }
+    gray_deque_count = 0;
+}
@@ -2,7 +2,9 @@
 #define CLOX_MEMORY_H
 
 #include "common.h"
+#include "heap.h"
 #include "object.h"
+#include "vm.h"
 
 // 型のメモリを指定した数分確保する
 #define ALLOCATE(type, count) \
@@ -34,6 +36,44 @@
 // 0以外    , > old_size , 既存の割り当てを拡大する
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
 
+/// @brief ヒープの上限を超えそうなら全世代のGCを行い，それでも足りなければメモリ不足の実行時エラーにする．
+/// 複数の配列をまとめて拡大する前に呼び出すと，途中で失敗して配列の大きさが食い違うことがない
+/// @param size これから割り当てるバイト数
+void ensure_heap_room(size_t size);
+
+// 最初の全世代のGCを実行するバイト数の既定値
+#define GC_INITIAL_HEAP (1024 * 1024)
+
+// 全世代のGCで生き残ったバイト数に掛けて，次のGCの閾値とする倍率の初期値
+#define GC_HEAP_GROW_FACTOR 2.0
+
+// 全世代のGCに使うCPU時間の割合の目標の既定値
+#define GC_CPU_TARGET 0.05
+
+// ペーサーが選ぶ倍率の範囲
+#define GC_PACER_MIN_GROWTH 1.25
+#define GC_PACER_MAX_GROWTH 3.0
+
+// 若い世代のガベージコレクションを実行するまでに割り当てるバイト数
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// インクリメンタルGCを1回進めるまでに割り当てるバイト数
+#define GC_STEP_SIZE (64 * 1024)
+
+// 並列マークのスレッド数の上限
+#define GC_THREADS_MAX 64
+
+// インクリメンタルGCの1回あたりの停止時間の予算の既定値（ナノ秒）
+#define GC_SLICE_BUDGET (500 * 1000)
+
+/// @brief オブジェクトにマークがついているかどうか．
+/// マークがついたまま生き残ったオブジェクトは古い世代として扱われる
+/// @param object 対象のオブジェクト
+/// @return マークがついているかどうか
+static inline bool is_marked(Obj* object) {
+    return heap_is_marked(object);
+}
+
 /// @brief オブジェクトにマークをつける
 /// @param object マークをつけられるオブジェクト
 void mark_object(Obj* object);
@@ -42,9 +82,104 @@ void mark_object(Obj* object);
 /// @param value マークをつけられる値
 void mark_value(Value value);
 
-/// @brief ごみを集める
+/// @brief コンパクションで移されたオブジェクトを指す値を，移動先を指すように書き換える
+/// @param value 値
+/// @return 書き換えた値
+static inline Value forward_value(Value value) {
+    if (IS_OBJ(value)) {
+        return OBJ_VAL(heap_forward(AS_OBJ(value)));
+    }
+    return value;
+}
+
+/// @brief 古いオブジェクトを記憶集合に加える
+/// @param object 若いオブジェクトへの参照を書き込まれた古いオブジェクト
+void remember_object(Obj* object);
+
+/// @brief インターン化したばかりの文字列を，若い世代のGCで文字列の表から掃除する対象に加える
+/// @param string 新しい文字列
+void track_young_string(ObjString* string);
+
+/// @brief 書き込みバリア．オブジェクトに値を書き込んだ後に呼び出す．
+/// インクリメンタルGCのマーク中は，マーク済みのオブジェクトから参照された値を灰色にする．
+/// それ以外のときは，古いオブジェクトが若いオブジェクトを参照するようになったら，記憶集合に加える．
+/// @param owner 値を書き込まれたオブジェクト
+/// @param value 書き込まれた値
+static inline void write_barrier(Obj* owner, Value value) {
+    if (!IS_OBJ(value) || !is_marked(owner) || is_marked(AS_OBJ(value))) {
+        return;
+    }
+
+    if (vm.gc_phase == GC_MARK) {
+        mark_object(AS_OBJ(value));
+    } else if (vm.gc_phase != GC_CONCURRENT_MARK && !owner->is_remembered) {
+        // 並行マーク中はスナップショットから到達できるオブジェクトが全てマークされるので，何もしなくてよい
+        remember_object(owner);
+    }
+}
+
+/// @brief 上書きされる参照をSATBバッファに記録する．gc_lockを持っているときに呼び出す
+/// @param object 上書きされる参照
+void satb_log(Obj* object);
+
+/// @brief SATB（snapshot-at-the-beginning）書き込みバリア．
+/// 並行マーク中にオブジェクトの値を上書きする前に，古い値を渡して呼び出す
+/// @param old 上書きされる値
+static inline void satb_barrier(Value old) {
+    if (vm.gc_phase == GC_CONCURRENT_MARK && IS_OBJ(old) && !is_marked(AS_OBJ(old))) {
+        satb_log(AS_OBJ(old));
+    }
+}
+
+/// @brief マークするスレッドがたどるかもしれないオブジェクトを書き換える前に呼び出す．
+/// end_heap_writeまではGCを始めないので，書き換えの途中で並行マークが始まることはない．
+/// 並行マーク中ならgc_lockを取る
+static inline void begin_heap_write() {
+    vm.heap_writing = true;
+    if (vm.gc_phase == GC_CONCURRENT_MARK) {
+        pthread_mutex_lock(&vm.gc_lock);
+    }
+}
+
+/// @brief begin_heap_writeで取ったgc_lockを手放す
+static inline void end_heap_write() {
+    if (vm.gc_phase == GC_CONCURRENT_MARK) {
+        pthread_mutex_unlock(&vm.gc_lock);
+    }
+    vm.heap_writing = false;
+}
+
+/// @brief オブジェクトに多数の値をまとめて書き込んだ後に呼び出す書き込みバリア．
+/// マーク中ならオブジェクトをもう一度灰色にし，そうでなければ記憶集合に加える
+/// @param object 値を書き込まれたオブジェクト
+void write_barrier_object(Obj* object);
+
+/// @brief オブジェクトのメモリをヒープに割り当てる．必要ならGCを行う
+/// @param size オブジェクトのバイト数
+/// @return 割り当てたメモリ
+Obj* allocate_cell(size_t size);
+
+/// @brief オブジェクトが持つメモリを解放する．オブジェクトのセルはsweepがヒープに返す
+/// @param object 解放されるオブジェクト
+void free_object(Obj* object);
+
+/// @brief 割り当てたばかりのオブジェクトをGCに登録する
+/// @param object 割り当てたオブジェクト
+void track_new_object(Obj* object);
+
+/// @brief 途中のインクリメンタルGCや並行GCを最後まで進める
+void finish_gc_cycle();
+
+/// @brief ごみを集める（全世代）．インクリメンタルGCの途中なら，それを終わらせてから集め直す
 void collect_garbage();
 
+/// @brief 若い世代のごみだけを集める
+void collect_young_garbage();
+
+/// @brief 疎なページのオブジェクトを他のページに詰め直し，全ての参照を書き換えて，空いたページをOSに返す．
+/// VMの外（Cの局所変数）にオブジェクトへのポインタが残っていない安全点で呼び出す
+void compact_heap();
+
 /// @brief 全てのオブジェクトを解放する
 void free_objects();
 
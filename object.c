@@ -1,6 +1,12 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "gcstats.h"
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -10,17 +16,24 @@
 #define ALLOCATE_OBJ(type, object_type) \
     (type*)allocate_object(sizeof(type), object_type)
 
+// この値未満のセレクタ番号は，常にvtableに入れる
+#define VTABLE_MIN 16
+// vtableの長さは，おおよそメソッドの個数のこの倍数までとする
+#define VTABLE_SPARSE_FACTOR 4
+
+// リストやマップを表示するときの入れ子の深さの上限
+#define PRINT_DEPTH_MAX 16
+
 /// @brief 指定したサイズのオブジェクトをヒープに割り当てる
 /// @param size バイト数
 /// @param type 
 /// @return 
 static Obj* allocate_object(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocate_cell(size);
     object->type = type;
-    object->is_marked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->is_remembered = false;
+    track_new_object(object);
+    count_allocation(type, page_of(object)->cell_size);
 
     #ifdef DEBUG_LOG_GC
     // メモリ割り当てのログ
@@ -40,20 +53,96 @@ ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method) {
 ObjClass* new_class(ObjString* name) {
     ObjClass* class_ = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     class_->name = name;
+    class_->vtable = NULL;
+    class_->vtable_count = 0;
+    class_->method_count = 0;
     init_table(&class_->methods);
     return class_;
 }
 
-ObjClosure* new_closure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
-    for (int i = 0; i < function->upvalue_count; i++) {
-        upvalues[i] = NULL;
+bool class_get_method(ObjClass* class_, int selector, Value* method) {
+    if (selector < class_->vtable_count && !IS_NIL(class_->vtable[selector])) {
+        *method = class_->vtable[selector];
+        return true;
+    }
+
+    // vtableに入らなかった疎なメソッド
+    return table_get(&class_->methods, selector_name(selector), method);
+}
+
+/// @brief セレクタ番号がvtableに収まるかどうかを判定する．
+/// メソッドの個数に比べてセレクタ番号が大きすぎるときは，配列が疎になるのでハッシュ表に入れる．
+/// @param class_ 対象のクラス
+/// @param selector セレクタ番号
+/// @return vtableに入れるべきかどうか
+static bool fits_vtable(ObjClass* class_, int selector) {
+    return selector < class_->vtable_count
+        || selector < VTABLE_MIN + (class_->method_count + 1) * VTABLE_SPARSE_FACTOR;
+}
+
+void class_set_method(ObjClass* class_, int selector, Value method) {
+    begin_heap_write();
+
+    if (!fits_vtable(class_, selector)) {
+        Value old;
+        if (table_get(&class_->methods, selector_name(selector), &old)) {
+            satb_barrier(old);
+        }
+        if (table_set(&class_->methods, selector_name(selector), method)) {
+            class_->method_count += 1;
+        }
+        write_barrier((Obj*)class_, method);
+        end_heap_write();
+        return;
+    }
+
+    if (selector >= class_->vtable_count) {
+        int old_count = class_->vtable_count;
+        int new_count = (selector + 8) & ~7;
+        class_->vtable = GROW_ARRAY(Value, class_->vtable, old_count, new_count);
+        for (int i = old_count; i < new_count; i++) {
+            class_->vtable[i] = NIL_VAL;
+        }
+        class_->vtable_count = new_count;
+    }
+
+    if (IS_NIL(class_->vtable[selector])) {
+        class_->method_count += 1;
+    }
+    satb_barrier(class_->vtable[selector]);
+    class_->vtable[selector] = method;
+    write_barrier((Obj*)class_, method);
+
+    end_heap_write();
+}
+
+void class_inherit(ObjClass* superclass, ObjClass* subclass) {
+    begin_heap_write();
+
+    if (superclass->vtable_count > 0) {
+        Value* vtable = ALLOCATE(Value, superclass->vtable_count);
+        memcpy(vtable, superclass->vtable, sizeof(Value) * superclass->vtable_count);
+        subclass->vtable = vtable;
+        subclass->vtable_count = superclass->vtable_count;
     }
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    table_add_all(&superclass->methods, &subclass->methods);
+    subclass->method_count = superclass->method_count;
+
+    // スーパークラスのメソッドが若い世代や白色かもしれない
+    write_barrier_object((Obj*)subclass);
+
+    end_heap_write();
+}
+
+ObjClosure* new_closure(ObjFunction* function) {
+    ObjClosure* closure = (ObjClosure*)allocate_object(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalue_count, OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
@@ -73,28 +162,191 @@ ObjInstance* new_instance(ObjClass* class_) {
     return instance;
 }
 
-ObjNative* new_native(NativeFn function) {
+ObjFloatArray* new_float_array(int count) {
+    ObjFloatArray* array = ALLOCATE_OBJ(ObjFloatArray, OBJ_FLOAT_ARRAY);
+    array->count = 0;
+    array->values = NULL;
+    if (count == 0) {
+        return array;
+    }
+
+    push(OBJ_VAL(array)); // GC対策
+    double* values = ALLOCATE(double, count);
+    memset(values, 0, sizeof(double) * count);
+    array->values = values;
+    array->count = count;
+    pop();
+    return array;
+}
+
+ObjList* new_list(Value* values, int count) {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    init_value_array(&list->items);
+    if (count == 0) {
+        return list;
+    }
+
+    push(OBJ_VAL(list)); // GC対策
+    Value* items = ALLOCATE(Value, count);
+    begin_heap_write();
+    memcpy(items, values, sizeof(Value) * count);
+    list->items.values = items;
+    list->items.capacity = count;
+    list->items.count = count;
+    // 要素は若い世代や白色かもしれない
+    write_barrier_object((Obj*)list);
+    end_heap_write();
+    pop();
+    return list;
+}
+
+void list_set(ObjList* list, int index, Value value) {
+    begin_heap_write();
+    satb_barrier(list->items.values[index]);
+    list->items.values[index] = value;
+    write_barrier((Obj*)list, value);
+    end_heap_write();
+}
+
+void list_insert(ObjList* list, int index, Value value) {
+    begin_heap_write();
+    // 末尾に加えて配列を大きくしてから，後ろの要素をずらして空ける
+    ValueArray* items = &list->items;
+    write_value_array(items, value);
+    memmove(&items->values[index + 1], &items->values[index], sizeof(Value) * (items->count - 1 - index));
+    items->values[index] = value;
+    write_barrier((Obj*)list, value);
+    end_heap_write();
+}
+
+Value list_pop(ObjList* list) {
+    begin_heap_write();
+    list->items.count -= 1;
+    Value value = list->items.values[list->items.count];
+    satb_barrier(value);
+    end_heap_write();
+    return value;
+}
+
+ObjMap* new_map() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    init_table(&map->table);
+    return map;
+}
+
+bool map_key(Value value, Value* key) {
+    if (IS_NIL(value)) {
+        return false;
+    }
+
+    if (IS_NUMBER(value) && !IS_INT(value)) {
+        double number = AS_NUMBER(value);
+        if (number != number) {
+            return false;
+        }
+        // 整数の値は整数にそろえる（-0も0になる）
+        if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number) {
+            value = INT_VAL((int32_t)number);
+        }
+    } else if (IS_ROPE(value)) {
+        // 平らにした文字列はロープから到達できる
+        value = OBJ_VAL(intern_string(flatten_rope(AS_ROPE(value))));
+    } else if (IS_STRING(value)) {
+        value = OBJ_VAL(intern_string(AS_STRING(value)));
+    }
+
+    *key = value;
+    return true;
+}
+
+bool map_get(ObjMap* map, Value key, Value* value) {
+    return table_get_value(&map->table, key, value);
+}
+
+void map_set(ObjMap* map, Value key, Value value) {
+    begin_heap_write();
+    Value old;
+    if (vm.gc_phase == GC_CONCURRENT_MARK && table_get_value(&map->table, key, &old)) {
+        satb_barrier(old);
+    }
+    table_set_value(&map->table, key, value);
+    write_barrier((Obj*)map, key);
+    write_barrier((Obj*)map, value);
+    end_heap_write();
+}
+
+bool map_delete(ObjMap* map, Value key) {
+    begin_heap_write();
+    Value old;
+    if (vm.gc_phase == GC_CONCURRENT_MARK && table_get_value(&map->table, key, &old)) {
+        // 表にあるキーは渡されたキーとビットが等しい
+        satb_barrier(key);
+        satb_barrier(old);
+    }
+    bool deleted = table_delete_value(&map->table, key);
+    end_heap_write();
+    return deleted;
+}
+
+ObjList* map_keys(ObjMap* map) {
+    ObjList* list = new_list(NULL, 0);
+    int count = map->table.count;
+    if (count == 0) {
+        return list;
+    }
+
+    push(OBJ_VAL(list)); // GC対策
+    Value* items = ALLOCATE(Value, count);
+    begin_heap_write();
+    int index = 0;
+    for (int i = 0; i < map->table.capacity; i++) {
+        Entry* entry = &map->table.entries[i];
+        if (!IS_NIL(entry->key)) {
+            items[index] = entry->key;
+            index += 1;
+        }
+    }
+    list->items.values = items;
+    list->items.capacity = count;
+    list->items.count = count;
+    write_barrier_object((Obj*)list);
+    end_heap_write();
+    pop();
+    return list;
+}
+
+ObjNative* new_native(NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
-/// @brief 文字列オブジェクトを作る
-/// @param chars 
-/// @param length 
-/// @return 
-static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/// @brief 文字列オブジェクトを作る．文字はオブジェクトの後ろにコピーする
+/// @param chars 文字
+/// @param length 文字数
+/// @param hash 文字列のハッシュ
+/// @return 新しい文字列
+static ObjString* allocate_string(const char* chars, int length, uint32_t hash) {
+    ObjString* string = (ObjString*)allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->is_interned = true;
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
 
     push(OBJ_VAL(string)); // GC対策
-    table_set(&vm.strings, string, NIL_VAL);
+    string_set_add(&vm.strings, string);
+    track_young_string(string);
     pop();
     return string;
 }
 
+#ifdef STRING_HASH_FNV
+
+void init_string_hash() {
+}
+
 /// @brief 文字列のハッシュを計算する（FNV-1a）
 /// @param key 
 /// @param length 
@@ -109,32 +361,352 @@ static uint32_t hash_string(const char* key, int length) {
     return hash;
 }
 
-ObjString* take_string(char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
+#else
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        // 既に文字列が存在すれば，渡されたものは開放する
-        // この関数に所有権が譲渡されているから
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+// wyhashの秘密の定数
+#define WY_SECRET0 0x2d358dccaa6c78a5ull
+#define WY_SECRET1 0x8bb84b93962eacc9ull
+#define WY_SECRET2 0x4b33a62ed433d4a3ull
+#define WY_SECRET3 0x4d5a2da51de1aa47ull
+
+/// @brief プロセスごとのハッシュの種．衝突するキーを外から狙って作れないようにする
+static uint64_t hash_seed;
+
+/// @brief 64ビットどうしの積の上位と下位を混ぜる
+/// @param a 
+/// @param b 
+/// @return 
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/// @brief 8バイトを読む（境界に揃っていなくてよい）
+static inline uint64_t wy_read8(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+}
+
+/// @brief 4バイトを読む（境界に揃っていなくてよい）
+static inline uint64_t wy_read4(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+void init_string_hash() {
+    uint64_t seed;
+    if (getentropy(&seed, sizeof(seed)) != 0) {
+        // 乱数が得られなければ，時刻とプロセスIDとスタックの位置（ASLR）から作る
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        seed = (uint64_t)now.tv_nsec ^ ((uint64_t)now.tv_sec << 32) ^ (uint64_t)getpid() ^ (uint64_t)(uintptr_t)&now;
     }
+    hash_seed = seed ^ wy_mix(seed ^ WY_SECRET0, WY_SECRET1);
+}
 
-    return allocate_string(chars, length, hash);
+/// @brief 文字列のハッシュを計算する（wyhash）．8バイトずつ読んで積で混ぜるので，長い文字列でも速い
+/// @param key 
+/// @param length 
+/// @return 
+static uint32_t hash_string(const char* key, int length) {
+    const uint8_t* p = (const uint8_t*)key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = hash_seed;
+    uint64_t a;
+    uint64_t b;
+
+    if (remaining <= 16) {
+        if (remaining >= 4) {
+            // 4バイトの読み込みを重ねて，4から16バイトを2つの語にまとめる
+            size_t middle = (remaining >> 3) << 2;
+            a = (wy_read4(p) << 32) | wy_read4(p + middle);
+            b = (wy_read4(p + remaining - 4) << 32) | wy_read4(p + remaining - 4 - middle);
+        } else if (remaining > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        if (remaining > 48) {
+            // 3本の独立した流れで48バイトずつ混ぜる
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ WY_SECRET1, wy_read8(p + 8) ^ seed);
+                seed1 = wy_mix(wy_read8(p + 16) ^ WY_SECRET2, wy_read8(p + 24) ^ seed1);
+                seed2 = wy_mix(wy_read8(p + 32) ^ WY_SECRET3, wy_read8(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = wy_mix(wy_read8(p) ^ WY_SECRET1, wy_read8(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // 最後の16バイト（前の塊と重なってもよい）
+        a = wy_read8(p + remaining - 16);
+        b = wy_read8(p + remaining - 8);
+    }
+
+    __uint128_t product = (__uint128_t)(a ^ WY_SECRET1) * (b ^ seed);
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+    return (uint32_t)wy_mix(a ^ WY_SECRET0 ^ (uint64_t)length, b ^ WY_SECRET1);
+}
+
+#endif
+
+/// @brief インターン化された文字列を再び使うときに呼び出す．
+/// 並行マーク中は，スナップショットから到達できなかった文字列が再び到達できるようになるので灰色にする
+/// @param string 見つかった文字列
+/// @return string
+static ObjString* reuse_interned(ObjString* string) {
+    begin_heap_write();
+    satb_barrier(OBJ_VAL(string));
+    end_heap_write();
+    return string;
 }
 
 ObjString* copy_string(const char* chars, int length) {
     uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString* interned = string_set_find(&vm.strings, chars, length, hash);
     // 文字列の複製の有無を確認し，既にあればそれを返す
     if (interned != NULL) {
-        return interned;
+        return reuse_interned(interned);
+    }
+
+    return allocate_string(chars, length, hash);
+}
+
+/// @brief インターン化しない文字列オブジェクトを作る．文字は呼び出し側が書き込む
+/// @param length 文字数
+/// @return 新しい文字列
+static ObjString* allocate_runtime_string(int length) {
+    ObjString* string = (ObjString*)allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->is_interned = false;
+    string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+ObjString* copy_runtime_string(const char* chars, int length) {
+    ObjString* string = allocate_runtime_string(length);
+    memcpy(string->chars, chars, length);
+    return string;
+}
+
+Value string_value(const char* chars, int length) {
+    #ifdef NAN_BOXING
+    if (length <= SHORT_STRING_MAX) {
+        return short_string_val(chars, length);
+    }
+    #endif
+    return OBJ_VAL(copy_string(chars, length));
+}
+
+Value runtime_string_value(const char* chars, int length) {
+    #ifdef NAN_BOXING
+    if (length <= SHORT_STRING_MAX) {
+        return short_string_val(chars, length);
+    }
+    #endif
+    return OBJ_VAL(copy_runtime_string(chars, length));
+}
+
+ObjString* intern_string(ObjString* string) {
+    if (string->is_interned) {
+        return string;
+    }
+
+    uint32_t hash = hash_string(string->chars, string->length);
+    ObjString* interned = string_set_find(&vm.strings, string->chars, string->length, hash);
+    if (interned != NULL) {
+        return reuse_interned(interned);
+    }
+
+    string->hash = hash;
+    string->is_interned = true;
+    push(OBJ_VAL(string)); // GC対策
+    string_set_add(&vm.strings, string);
+    track_young_string(string);
+    pop();
+    return string;
+}
+
+/// @brief 文字列の値の文字を得る
+/// @param value 短い文字列か文字列
+/// @param buffer 短い文字列の文字を書き出す先
+/// @return 文字
+static const char* string_chars(Value value, char* buffer) {
+    if (IS_SHORT_STRING(value)) {
+        short_string_chars(value, buffer);
+        return buffer;
+    }
+    return AS_STRING(value)->chars;
+}
+
+Value concatenate_strings(Value a, Value b) {
+    char a_buffer[SHORT_STRING_MAX + 1];
+    char b_buffer[SHORT_STRING_MAX + 1];
+    int a_length = text_value_length(a);
+    int b_length = text_value_length(b);
+    #ifdef NAN_BOXING
+    if (a_length + b_length <= SHORT_STRING_MAX) {
+        char chars[SHORT_STRING_MAX];
+        memcpy(chars, string_chars(a, a_buffer), a_length);
+        memcpy(chars + a_length, string_chars(b, b_buffer), b_length);
+        return short_string_val(chars, a_length + b_length);
+    }
+    #endif
+
+    // 文字列オブジェクトに直接連結する．ハッシュやインターン化は必要になるまで遅らせる
+    ObjString* result = allocate_runtime_string(a_length + b_length);
+    memcpy(result->chars, string_chars(a, a_buffer), a_length);
+    memcpy(result->chars + a_length, string_chars(b, b_buffer), b_length);
+    return OBJ_VAL(result);
+}
+
+// ロープを平らにするときに，Cのスタックに積める残りの部分の数
+#define ROPE_LOCAL_PENDING 32
+
+ObjRope* new_rope(Obj* left, Obj* right) {
+    int length = text_length(left) + text_length(right);
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->flat = NULL;
+    rope->left = left;
+    rope->right = right;
+    return rope;
+}
+
+void write_rope_chars(ObjRope* rope, char* chars) {
+    // 後ろの部分から末尾に向けて書く．連結を繰り返したロープは左に深いので，残りの前の部分を積むスタックは浅い．
+    // 浅いうちはCのスタックの配列に積み，比べるたびに平らにする短いロープでmallocしないようにする
+    Obj* local[ROPE_LOCAL_PENDING];
+    Obj** pending = local;
+    int count = 0;
+    int capacity = ROPE_LOCAL_PENDING;
+    char* end = chars + rope->length;
+    Obj* node = (Obj*)rope;
+    for (;;) {
+        if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat == NULL) {
+            if (count == capacity) {
+                capacity = GROW_CAPACITY(capacity);
+                Obj** grown = malloc(sizeof(Obj*) * capacity);
+                if (grown == NULL) {
+                    if (pending != local) {
+                        free(pending);
+                    }
+                    raise_out_of_memory();
+                }
+                memcpy(grown, pending, sizeof(Obj*) * count);
+                if (pending != local) {
+                    free(pending);
+                }
+                pending = grown;
+            }
+            pending[count++] = ((ObjRope*)node)->left;
+            node = ((ObjRope*)node)->right;
+            continue;
+        }
+
+        ObjString* string = node->type == OBJ_ROPE ? ((ObjRope*)node)->flat : (ObjString*)node;
+        end -= string->length;
+        memcpy(end, string->chars, string->length);
+        if (count == 0) {
+            break;
+        }
+        node = pending[--count];
+    }
+    if (pending != local) {
+        free(pending);
+    }
+}
+
+ObjString* flatten_rope(ObjRope* rope) {
+    if (rope->flat != NULL) {
+        return rope->flat;
+    }
+
+    push(OBJ_VAL(rope)); // GC対策
+    ObjString* flat = allocate_runtime_string(rope->length);
+    write_rope_chars(rope, flat->chars);
+
+    // 部分はもう要らないので手放し，木をたどらなくてよいようにする
+    begin_heap_write();
+    satb_barrier(OBJ_VAL(rope->left));
+    satb_barrier(OBJ_VAL(rope->right));
+    rope->left = NULL;
+    rope->right = NULL;
+    rope->flat = flat;
+    write_barrier((Obj*)rope, OBJ_VAL(flat));
+    end_heap_write();
+    pop();
+    return flat;
+}
+
+ObjStringBuilder* new_string_builder() {
+    ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    return builder;
+}
+
+/// @brief 文字列ビルダーの配列に，追記する文字の分の空きを作る．容量は倍々に増やす
+/// @param builder 
+/// @param length 追記する文字数
+/// @return 追記を始める位置
+static char* reserve_string_builder(ObjStringBuilder* builder, int length) {
+    if (length > INT_MAX - builder->length) {
+        raise_out_of_memory();
+    }
+
+    int needed = builder->length + length;
+    if (needed > builder->capacity) {
+        int capacity = builder->capacity;
+        while (capacity < needed) {
+            capacity = capacity > INT_MAX / 2 ? INT_MAX : GROW_CAPACITY(capacity);
+        }
+        builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity, capacity);
+        builder->capacity = capacity;
+    }
+
+    char* start = builder->chars + builder->length;
+    builder->length = needed;
+    return start;
+}
+
+void string_builder_append(ObjStringBuilder* builder, const char* chars, int length) {
+    if (length == 0) {
+        return;
+    }
+    memcpy(reserve_string_builder(builder, length), chars, length);
+}
+
+void string_builder_append_text(ObjStringBuilder* builder, Value text) {
+    // 配列を大きくするとGCが走るので，文字を読むのは空きを作った後にする
+    char* start = reserve_string_builder(builder, text_value_length(text));
+    if (IS_SHORT_STRING(text)) {
+        short_string_chars(text, start);
+        return;
     }
 
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    Obj* object = AS_OBJ(text);
+    if (object->type == OBJ_STRING) {
+        memcpy(start, ((ObjString*)object)->chars, ((ObjString*)object)->length);
+    } else if (((ObjRope*)object)->flat != NULL) {
+        memcpy(start, ((ObjRope*)object)->flat->chars, ((ObjRope*)object)->length);
+    } else {
+        write_rope_chars((ObjRope*)object, start);
+    }
 }
 
 ObjUpvalue* new_upvalue(Value* slot) {
@@ -156,6 +728,74 @@ static void print_function(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+// 表示しているリストやマップの入れ子の深さ
+static int print_depth = 0;
+
+/// @brief リストを表示する．自分自身を含むリストでも止まるように，入れ子はPRINT_DEPTH_MAXまで表示する
+/// @param list
+static void print_list(ObjList* list) {
+    if (print_depth >= PRINT_DEPTH_MAX) {
+        printf("[...]");
+        return;
+    }
+
+    print_depth += 1;
+    printf("[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) {
+            printf(", ");
+        }
+        print_value(list->items.values[i]);
+    }
+    printf("]");
+    print_depth -= 1;
+}
+
+/// @brief マップを表示する．順序は表の中の並びで，入れ子はPRINT_DEPTH_MAXまで表示する
+/// @param map
+static void print_map(ObjMap* map) {
+    if (print_depth >= PRINT_DEPTH_MAX) {
+        printf("{...}");
+        return;
+    }
+
+    print_depth += 1;
+    printf("{");
+    bool first = true;
+    for (int i = 0; i < map->table.capacity; i++) {
+        Entry* entry = &map->table.entries[i];
+        if (IS_NIL(entry->key)) {
+            continue;
+        }
+        if (!first) {
+            printf(", ");
+        }
+        first = false;
+        print_value(entry->key);
+        printf(": ");
+        print_value(entry->value);
+    }
+    printf("}");
+    print_depth -= 1;
+}
+
+/// @brief ロープをプリントする．インターン化する手間をかけないよう，平らにしていなければ一時的な領域で連結する
+/// @param rope 
+static void print_rope(ObjRope* rope) {
+    if (rope->flat != NULL) {
+        printf("%s", rope->flat->chars);
+        return;
+    }
+
+    char* chars = malloc(rope->length);
+    if (chars == NULL) {
+        raise_out_of_memory();
+    }
+    write_rope_chars(rope, chars);
+    fwrite(chars, 1, rope->length, stdout);
+    free(chars);
+}
+
 void print_object(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
@@ -173,12 +813,27 @@ void print_object(Value value) {
         case OBJ_INSTANCE:
             printf("%s instance", AS_INSTANCE(value)->class_->name->chars);
             break;
+        case OBJ_FLOAT_ARRAY:
+            printf("<float array %d>", AS_FLOAT_ARRAY(value)->count);
+            break;
+        case OBJ_LIST:
+            print_list(AS_LIST(value));
+            break;
+        case OBJ_MAP:
+            print_map(AS_MAP(value));
+            break;
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_ROPE:
+            print_rope(AS_ROPE(value));
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
+        case OBJ_STRING_BUILDER:
+            printf("<string builder>");
+            break;
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
@@ -1,6 +1,8 @@
 #ifndef CLOX_OBJECT_H
 #define CLOX_OBJECT_H
 
+#include <string.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
@@ -15,14 +17,24 @@
 #define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
 // クロージャオブジェクトがどうか
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
+// 浮動小数点数の配列かどうか
+#define IS_FLOAT_ARRAY(value) is_obj_type(value, OBJ_FLOAT_ARRAY)
 // 関数オブジェクトかどうか
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 // インスタンスオブジェクトかどうか
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
+// リストかどうか
+#define IS_LIST(value) is_obj_type(value, OBJ_LIST)
+// マップかどうか
+#define IS_MAP(value) is_obj_type(value, OBJ_MAP)
 // ネイティブ関数オブジェクトかどうか
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
+// ロープかどうか
+#define IS_ROPE(value) is_obj_type(value, OBJ_ROPE)
 // 文字列かどうか
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
+// 文字列ビルダーかどうか
+#define IS_STRING_BUILDER(value) is_obj_type(value, OBJ_STRING_BUILDER)
 
 // valueをObjBoundMethod*とする
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -30,14 +42,24 @@
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 // valueをObjClosure*とする
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+// valueをObjFloatArray*とする
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray*)AS_OBJ(value))
 // valueをObjFunction*とする
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 // valueをObjInstance*とする
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
-// valueをNativeFnとする
-#define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+// valueをObjList*とする
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+// valueをObjMap*とする
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+// valueをObjNative*とする
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+// valueをObjRope*とする
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 // valueをObjString*とする
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+// valueをObjStringBuilder*とする
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
 // valueをchar*にする
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
@@ -49,25 +71,37 @@ typedef enum {
     OBJ_CLASS,
     /// @brief クロージャオブジェクト
     OBJ_CLOSURE,
+    /// @brief 浮動小数点数の配列
+    OBJ_FLOAT_ARRAY,
     /// @brief 関数オブジェクト
     OBJ_FUNCTION,
     /// @brief インスタンスオブジェクト
     OBJ_INSTANCE,
+    /// @brief リスト
+    OBJ_LIST,
+    /// @brief マップ
+    OBJ_MAP,
     /// @brief ネイティブ関数オブジェクト
     OBJ_NATIVE,
+    /// @brief ロープ（連結を遅らせた文字列）
+    OBJ_ROPE,
     /// @brief 文字列
     OBJ_STRING,
+    /// @brief 文字列ビルダー
+    OBJ_STRING_BUILDER,
     /// @brief 上位値オブジェクト
     OBJ_UPVALUE,
 } ObjType;
 
+// ObjTypeの数（最後のObjTypeに合わせる）
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// ヘッダは2バイトなので，後ろに続く4バイトの欄はヘッダの詰め物の位置に置かれる
 struct Obj {
-    /// @brief オブジェクトの種類
-    ObjType type;
-    /// @brief GCにマークがつけられているか
-    bool is_marked;
-    /// @brief GC用のオブジェクトの連結リスト
-    struct Obj* next;
+    /// @brief オブジェクトの種類（ObjTypeの値）
+    uint8_t type;
+    /// @brief 記憶集合に入っているかどうか
+    bool is_remembered;
 };
 
 /// @brief 関数オブジェクト
@@ -90,17 +124,51 @@ typedef Value (*NativeFn)(int arg_count, Value* args);
 typedef struct {
     Obj obj;
     NativeFn function;
+    /// @brief 引数の個数（メソッドならレシーバを除く）．-1なら可変個で，ネイティブ関数が確かめる
+    int arity;
 } ObjNative;
 
 // 先頭の数バイトはobjと一致する（ポインタのキャスト可能）
 struct ObjString {
     Obj obj;
+    /// @brief インターン化されているかどうか．実行時に作った文字列は，必要になるまでインターン化しない
+    bool is_interned;
     int length;
-    char* chars;
-    /// @brief 文字列のハッシュ
+    /// @brief 文字列のハッシュ．インターン化されていなければ計算していない
     uint32_t hash;
+    /// @brief 文字（NUL終端）．オブジェクトと一緒に割り当てる
+    char chars[];
 };
 
+// 連結した長さがこれ以上になるときはロープを作り，短ければその場で連結する．
+// 短い連結はその場でコピーする方が，ロープを作って後で平らにするより速い．
+// 比べるたびに平らにされる数KBの連結では，ロープの割り当てと平らにする手間がコピーの節約を上回るので，4KBからにする
+#define ROPE_MIN_LENGTH 4096
+
+/// @brief ロープ．文字列の連結を木にしておき，文字が必要になったときに一度だけ平らにする
+typedef struct {
+    Obj obj;
+    /// @brief 文字数
+    int length;
+    /// @brief 平らにした文字列．まだ平らにしていなければNULL
+    ObjString* flat;
+    /// @brief 前の部分（文字列かロープ）．平らにしたらNULL
+    Obj* left;
+    /// @brief 後ろの部分（文字列かロープ）．平らにしたらNULL
+    Obj* right;
+} ObjRope;
+
+/// @brief 文字列ビルダー．文字を追記していき，最後に一度だけ文字列にする
+typedef struct {
+    Obj obj;
+    /// @brief 文字数
+    int length;
+    /// @brief 文字の配列の容量
+    int capacity;
+    /// @brief 文字の配列（NUL終端しない）．reallocateで割り当てる
+    char* chars;
+} ObjStringBuilder;
+
 /// @brief 上位値オブジェクト
 typedef struct ObjUpvalue {
     Obj obj;
@@ -115,12 +183,12 @@ typedef struct ObjUpvalue {
 /// @brief クロージャオブジェクト
 typedef struct {
     Obj obj;
-    /// @brief ラップする関数オブジェクト
-    ObjFunction* function;
-    /// @brief 上位値のポインタの配列
-    ObjUpvalue** upvalues;
     /// @brief 上位値のポインタの配列の長さ
     int upvalue_count;
+    /// @brief ラップする関数オブジェクト
+    ObjFunction* function;
+    /// @brief 上位値のポインタの配列．オブジェクトと一緒に割り当てる
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
 /// @brief クラスオブジェクト
@@ -128,7 +196,13 @@ typedef struct {
     Obj obj;
     /// @brief 名前
     ObjString* name;
-    /// @brief メソッド表
+    /// @brief セレクタ番号で引くメソッドの配列（未定義のスロットはnil）
+    Value* vtable;
+    /// @brief vtableの長さ
+    int vtable_count;
+    /// @brief 定義されているメソッドの個数
+    int method_count;
+    /// @brief vtableに入れると疎になりすぎるメソッドの表（名前で引く）
     Table methods;
 } ObjClass;
 
@@ -141,6 +215,29 @@ typedef struct {
     Table fields;
 } ObjInstance;
 
+/// @brief 浮動小数点数の配列．要素をボックス化せずに連続して並べる
+typedef struct {
+    Obj obj;
+    /// @brief 要素の個数．作った後は変わらない
+    int count;
+    /// @brief 要素の配列．reallocateで割り当てる
+    double* values;
+} ObjFloatArray;
+
+/// @brief リスト．値を連続した配列に並べる
+typedef struct {
+    Obj obj;
+    /// @brief 要素の配列．reallocateで割り当てる
+    ValueArray items;
+} ObjList;
+
+/// @brief マップ．nil以外の任意の値をキーにできる．列挙の順序は決まらない
+typedef struct {
+    Obj obj;
+    /// @brief キーと値の表．キーはmap_keyで正規化したもの
+    Table table;
+} ObjMap;
+
 /// @brief 束縛メソッドオブジェクト
 typedef struct {
     Obj obj;
@@ -161,6 +258,24 @@ ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method);
 /// @return 新しいクラスオブジェクト
 ObjClass* new_class(ObjString* name);
 
+/// @brief クラスのメソッドをセレクタ番号で探す
+/// @param class_ 探すクラス
+/// @param selector メソッド名のセレクタ番号
+/// @param method 見つかった場合は，そのメソッドを格納する
+/// @return メソッドが見つかったかどうか
+bool class_get_method(ObjClass* class_, int selector, Value* method);
+
+/// @brief クラスにメソッドを定義する
+/// @param class_ 定義先のクラス
+/// @param selector メソッド名のセレクタ番号
+/// @param method メソッド
+void class_set_method(ObjClass* class_, int selector, Value method);
+
+/// @brief スーパークラスのメソッドを全てサブクラスにコピーする
+/// @param superclass コピー元
+/// @param subclass コピー先（メソッドが未定義であること）
+void class_inherit(ObjClass* superclass, ObjClass* subclass);
+
 /// @brief 関数オブジェクトから新しいクロージャオブジェクトを作る
 /// @param function 関数オブジェクト
 /// @return 新しいクロージャオブジェクト
@@ -174,23 +289,160 @@ ObjFunction* new_function();
 /// @return 新しいインスタンスオブジェクト
 ObjInstance* new_instance(ObjClass* class_);
 
+/// @brief 要素が全て0の新しい浮動小数点数の配列を作る
+/// @param count 要素の個数
+/// @return 新しい浮動小数点数の配列
+ObjFloatArray* new_float_array(int count);
+
+/// @brief 値を並べた新しいリストを作る
+/// @param values 要素の値．GCから到達できるようにしておく（VMのスタックなど）
+/// @param count 要素の個数
+/// @return 新しいリスト
+ObjList* new_list(Value* values, int count);
+
+/// @brief リストの要素を書き換える
+/// @param list 
+/// @param index 位置．0以上count未満
+/// @param value 新しい値
+void list_set(ObjList* list, int index, Value value);
+
+/// @brief リストの指定した位置に値を挿入する．後ろの要素は1つずつずれる
+/// @param list 
+/// @param index 位置．0以上count以下（countなら末尾に加える）
+/// @param value 挿入する値．GCから到達できるようにしておく
+void list_insert(ObjList* list, int index, Value value);
+
+/// @brief リストの末尾の要素を取り除く
+/// @param list 空でないリスト
+/// @return 取り除いた値
+Value list_pop(ObjList* list);
+
+/// @brief 空のマップを作る
+/// @return 新しいマップ
+ObjMap* new_map();
+
+/// @brief 値をマップのキーに正規化する．整数の値の数は整数にし，文字列はインターン化する（割り当てることがある）
+/// @param value キーにする値．GCから到達できるようにしておく
+/// @param key 正規化したキーを格納する
+/// @return キーにできる値か（nilとNaNはキーにできない）
+bool map_key(Value value, Value* key);
+
+/// @brief マップのキーの値を得る
+/// @param map 
+/// @param key 正規化したキー
+/// @param value 見つかった場合は，その値を格納する
+/// @return 見つかったかどうか
+bool map_get(ObjMap* map, Value key, Value* value);
+
+/// @brief マップにキーと値を置く
+/// @param map 
+/// @param key 正規化したキー．GCから到達できるようにしておく
+/// @param value 値
+void map_set(ObjMap* map, Value key, Value value);
+
+/// @brief マップからキーを取り除く
+/// @param map 
+/// @param key 正規化したキー
+/// @return 取り除いたかどうか
+bool map_delete(ObjMap* map, Value key);
+
+/// @brief マップのキーを並べたリストを作る
+/// @param map GCから到達できるようにしておく
+/// @return 新しいリスト
+ObjList* map_keys(ObjMap* map);
+
 /// @brief 新しいネイティブ関数オブジェクトを作る
 /// @param function 新しいネイティブ関数
+/// @param arity 引数の個数．-1なら可変個
 /// @return 新しいネイティブ関数オブジェクト
-ObjNative* new_native(NativeFn function);
+ObjNative* new_native(NativeFn function, int arity);
 
-/// @brief 文字列を所有する
-/// @param chars 
-/// @param length 
-/// @return 
-ObjString* take_string(char* chars, int length);
+/// @brief 文字列のハッシュの種を決める．文字列を作る前に一度呼び出す
+void init_string_hash();
 
-/// @brief 文字列をコピーする
+/// @brief 文字列をコピーしてインターン化する．リテラルや識別子など，表のキーになる文字列に使う
 /// @param chars 
 /// @param length 
 /// @return 
 ObjString* copy_string(const char* chars, int length);
 
+/// @brief 実行時に作る文字列をコピーする．ハッシュの計算とインターン化はしない
+/// @param chars 文字
+/// @param length 文字数
+/// @return 新しい文字列（インターン化されていない）
+ObjString* copy_runtime_string(const char* chars, int length);
+
+/// @brief 文字列の値を作る．SHORT_STRING_MAX文字以下ならValueに埋め込んだ短い文字列にし，
+/// それより長ければインターン化した文字列にする．文字列リテラルに使う
+/// @param chars 文字
+/// @param length 文字数
+/// @return 
+Value string_value(const char* chars, int length);
+
+/// @brief 実行時に作る文字列の値を作る．長ければインターン化していない文字列にする
+/// @param chars 文字
+/// @param length 文字数
+/// @return 
+Value runtime_string_value(const char* chars, int length);
+
+/// @brief 文字列をインターン化する．表のキーに使う前に呼び出す．stringはGCから到達できるようにしておく
+/// @param string インターン化する文字列
+/// @return 同じ文字を持つインターン化された文字列（stringかもしれない）
+ObjString* intern_string(ObjString* string);
+
+/// @brief 2つの文字列の文字が等しいかどうかを判定する
+/// @param a 
+/// @param b 
+/// @return 
+static inline bool strings_equal(ObjString* a, ObjString* b) {
+    if (a == b) {
+        return true;
+    }
+    // インターン化された文字列どうしは，同じ文字なら同じオブジェクトになっている
+    if ((a->is_interned && b->is_interned) || a->length != b->length) {
+        return false;
+    }
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+/// @brief 2つの文字列を連結した文字列を得る．aとbはGCから到達できるようにしておく
+/// @param a 前の文字列（短い文字列か文字列）
+/// @param b 後ろの文字列（短い文字列か文字列）
+/// @return 連結した文字列（短い文字列か，インターン化されていない文字列）
+Value concatenate_strings(Value a, Value b);
+
+/// @brief 2つの部分を連結したロープを作る．leftとrightはGCから到達できるようにしておく
+/// @param left 前の部分（文字列か平らにしていないロープ）
+/// @param right 後ろの部分（文字列か平らにしていないロープ）
+/// @return 新しいロープ
+ObjRope* new_rope(Obj* left, Obj* right);
+
+/// @brief ロープを平らにした文字列を得る．結果は覚えておき，部分への参照は手放す
+/// @param rope 平らにするロープ
+/// @return 平らにした文字列（インターン化されていない）
+ObjString* flatten_rope(ObjRope* rope);
+
+/// @brief ロープの文字を領域に書き込む．GCは起こさない
+/// @param rope 書き込むロープ
+/// @param chars 書き込む先（rope->length文字）
+void write_rope_chars(ObjRope* rope, char* chars);
+
+/// @brief 空の文字列ビルダーを作る
+/// @return 新しい文字列ビルダー
+ObjStringBuilder* new_string_builder();
+
+/// @brief 文字列ビルダーに文字を追記する．builderはGCから到達できるようにしておく
+/// @param builder 追記先
+/// @param chars 文字（builderの配列の中を指していないこと）
+/// @param length 文字数
+void string_builder_append(ObjStringBuilder* builder, const char* chars, int length);
+
+/// @brief 文字列ビルダーに文字列かロープを追記する．ロープは平らにせずに直接書き込む．
+/// builderとtextはGCから到達できるようにしておく
+/// @param builder 追記先
+/// @param text 文字列（短い文字列を含む）かロープ
+void string_builder_append_text(ObjStringBuilder* builder, Value text);
+
 /// @brief 新しい上位値オブジェクトを作る
 /// @param slot キャプチャした変数があるスロット
 /// @return 新しい上位値オブジェクト
@@ -208,4 +460,26 @@ static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/// @brief 値が文字列（短い文字列を含む）かロープかどうかを判定する
+/// @param value 
+/// @return 
+static inline bool is_text(Value value) {
+    return IS_SHORT_STRING(value)
+        || (IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STRING || AS_OBJ(value)->type == OBJ_ROPE));
+}
+
+/// @brief 文字列かロープの文字数を得る
+/// @param text 文字列かロープ
+/// @return 文字数
+static inline int text_length(Obj* text) {
+    return text->type == OBJ_STRING ? ((ObjString*)text)->length : ((ObjRope*)text)->length;
+}
+
+/// @brief 文字列（短い文字列を含む）かロープの値の文字数を得る
+/// @param value 文字列かロープ
+/// @return 文字数
+static inline int text_value_length(Value value) {
+    return IS_SHORT_STRING(value) ? short_string_length(value) : text_length(AS_OBJ(value));
+}
+
 #endif
\ No newline at end of file
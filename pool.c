@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// ブロックの大きさの単位
+#define POOL_GRANULE 16
+
+// まとめてmallocする領域の大きさ．ブロックはここから切り出す
+#define POOL_CHUNK_SIZE (64 * 1024)
+
+/// @brief サイズクラスごとのブロックの大きさ
+static const size_t block_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+// サイズクラスの数
+#define BLOCK_CLASS_COUNT ((int)(sizeof(block_sizes) / sizeof(block_sizes[0])))
+
+/// @brief まとめてmallocした領域．free_poolで解放するために連結しておく
+typedef struct PoolChunk {
+    struct PoolChunk* next;
+} PoolChunk;
+
+// 領域のヘッダの後ろからブロックを切り出す
+#define CHUNK_HEADER_SIZE \
+    ((sizeof(PoolChunk) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+/// @brief サイズクラスごとの空きブロックの連結リスト（空きブロックの先頭に次の空きブロックを書く）
+static void* free_blocks[BLOCK_CLASS_COUNT];
+
+/// @brief バイト数（POOL_GRANULE単位）からサイズクラスの番号を引く表
+static uint8_t class_of_granules[POOL_MAX_BLOCK / POOL_GRANULE + 1];
+
+/// @brief class_of_granulesを作ったかどうか
+static bool class_table_ready = false;
+
+/// @brief mallocした全ての領域
+static PoolChunk* chunks = NULL;
+
+/// @brief 現在の領域のまだ切り出していない部分
+static char* chunk_cursor = NULL;
+static char* chunk_limit = NULL;
+
+/// @brief class_of_granulesを作る
+static void build_class_table() {
+    int index = 0;
+    for (int granules = 0; granules <= POOL_MAX_BLOCK / POOL_GRANULE; granules++) {
+        while (block_sizes[index] < (size_t)granules * POOL_GRANULE) {
+            index += 1;
+        }
+        class_of_granules[granules] = (uint8_t)index;
+    }
+    class_table_ready = true;
+}
+
+/// @brief バイト数からサイズクラスを求める
+/// @param size バイト数（POOL_MAX_BLOCK以下）
+/// @return サイズクラスの番号
+static int class_of(size_t size) {
+    if (!class_table_ready) {
+        build_class_table();
+    }
+    return class_of_granules[(size + POOL_GRANULE - 1) / POOL_GRANULE];
+}
+
+/// @brief 空きブロックがないとき，領域から新しいブロックを切り出す
+/// @param size_class サイズクラスの番号
+/// @return ブロック．メモリを得られなければNULL
+static void* carve_block(int size_class) {
+    size_t size = block_sizes[size_class];
+    if (chunk_cursor == NULL || (size_t)(chunk_limit - chunk_cursor) < size) {
+        // 残りは空きリストに入れずに捨てる（最大でPOOL_MAX_BLOCK未満）
+        PoolChunk* chunk = malloc(POOL_CHUNK_SIZE);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = chunks;
+        chunks = chunk;
+        chunk_cursor = (char*)chunk + CHUNK_HEADER_SIZE;
+        chunk_limit = (char*)chunk + POOL_CHUNK_SIZE;
+    }
+
+    void* block = chunk_cursor;
+    chunk_cursor += size;
+    return block;
+}
+
+void* pool_allocate(size_t size) {
+    if (size > POOL_MAX_BLOCK) {
+        return malloc(size);
+    }
+
+    int size_class = class_of(size);
+    void* block = free_blocks[size_class];
+    if (block == NULL) {
+        return carve_block(size_class);
+    }
+    free_blocks[size_class] = *(void**)block;
+    return block;
+}
+
+void pool_free(void* pointer, size_t size) {
+    if (pointer == NULL) {
+        return;
+    }
+    if (size > POOL_MAX_BLOCK) {
+        free(pointer);
+        return;
+    }
+
+    int size_class = class_of(size);
+    *(void**)pointer = free_blocks[size_class];
+    free_blocks[size_class] = pointer;
+}
+
+void* pool_reallocate(void* pointer, size_t old_size, size_t new_size) {
+    if (pointer == NULL) {
+        return pool_allocate(new_size);
+    }
+
+    if (old_size > POOL_MAX_BLOCK && new_size > POOL_MAX_BLOCK) {
+        return realloc(pointer, new_size);
+    }
+    if (old_size <= POOL_MAX_BLOCK && new_size <= POOL_MAX_BLOCK
+            && class_of(old_size) == class_of(new_size)) {
+        return pointer;
+    }
+
+    void* result = pool_allocate(new_size);
+    if (result == NULL) {
+        return NULL;
+    }
+    memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    pool_free(pointer, old_size);
+    return result;
+}
+
+void free_pool() {
+    while (chunks != NULL) {
+        PoolChunk* next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+    chunk_cursor = NULL;
+    chunk_limit = NULL;
+    for (int i = 0; i < BLOCK_CLASS_COUNT; i++) {
+        free_blocks[i] = NULL;
+    }
+}
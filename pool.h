@@ -0,0 +1,33 @@
+/*
+小さなメモリブロックをサイズクラスごとの空きリストから割り当てるアロケータ
+*/
+
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include "common.h"
+
+// これより大きなブロックはmallocで割り当てる
+#define POOL_MAX_BLOCK 1024
+
+/// @brief ブロックを割り当てる
+/// @param size バイト数（0より大きい）
+/// @return 割り当てたブロック．メモリを得られなければNULL
+void* pool_allocate(size_t size);
+
+/// @brief ブロックを解放する
+/// @param pointer ブロック．NULLなら何もしない
+/// @param size 割り当てたときのバイト数
+void pool_free(void* pointer, size_t size);
+
+/// @brief ブロックの大きさを変える．同じサイズクラスに収まるならそのまま返す
+/// @param pointer ブロック．NULLなら新しく割り当てる
+/// @param old_size 割り当てたときのバイト数
+/// @param new_size 新しいバイト数（0より大きい）
+/// @return 新しいブロック．メモリを得られなければNULL（元のブロックはそのまま残る）
+void* pool_reallocate(void* pointer, size_t old_size, size_t new_size);
+
+/// @brief アロケータが確保した全てのメモリを解放する
+void free_pool();
+
+#endif
@@ -0,0 +1,154 @@
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "stringset.h"
+
+#define STRING_SET_MAX_LOAD 0.75
+
+// 要素の個数がこの割合を下回っていたら，次に文字列を加えるときに配列を縮める
+#define STRING_SET_MIN_LOAD 0.125
+
+// 配列の最小の容量
+#define STRING_SET_MIN_CAPACITY 8
+
+void init_string_set(StringSet* set) {
+    set->count = 0;
+    set->capacity = 0;
+    set->slots = NULL;
+}
+
+void free_string_set(StringSet* set) {
+    FREE_ARRAY(StringSlot, set->slots, set->capacity);
+    init_string_set(set);
+}
+
+/// @brief 空きの要素を探して文字列を置く
+/// @param slots 要素の配列
+/// @param capacity 要素の配列の容量
+/// @param slot 置く要素
+static void insert_slot(StringSlot* slots, int capacity, StringSlot slot) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = slot.hash & mask;
+    while (slots[index].string != NULL) {
+        index = (index + 1) & mask;
+    }
+    slots[index] = slot;
+}
+
+/// @brief 要素の配列を大きくして，全ての文字列を置き直す
+/// @param set 集合
+/// @param capacity 新しい容量
+static void adjust_capacity(StringSet* set, int capacity) {
+    StringSlot* slots = ALLOCATE(StringSlot, capacity);
+    for (int i = 0; i < capacity; i++) {
+        slots[i].string = NULL;
+    }
+
+    // 割り当てでGCが走ると文字列が取り除かれるので，古い配列は割り当ての後で読む
+    for (int i = 0; i < set->capacity; i++) {
+        if (set->slots[i].string != NULL) {
+            insert_slot(slots, capacity, set->slots[i]);
+        }
+    }
+
+    FREE_ARRAY(StringSlot, set->slots, set->capacity);
+    set->slots = slots;
+    set->capacity = capacity;
+}
+
+/// @brief 要素を空け，同じ並びの後ろの要素を本来の位置に近づくように詰める
+/// @param set 集合
+/// @param index 空ける要素の位置
+static void remove_slot(StringSet* set, uint32_t index) {
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    uint32_t hole = index;
+    for (uint32_t next = (hole + 1) & mask; set->slots[next].string != NULL; next = (next + 1) & mask) {
+        // 本来の位置から見て，空いた位置がnextより手前にあれば，そこへ移しても探索で見つかる
+        uint32_t home = set->slots[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            set->slots[hole] = set->slots[next];
+            hole = next;
+        }
+    }
+    set->slots[hole].string = NULL;
+    set->count -= 1;
+}
+
+ObjString* string_set_find(StringSet* set, const char* chars, int length, uint32_t hash) {
+    if (set->count == 0) {
+        return NULL;
+    }
+
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    for (uint32_t index = hash & mask; ; index = (index + 1) & mask) {
+        StringSlot* slot = &set->slots[index];
+        if (slot->string == NULL) {
+            return NULL;
+        }
+        // ハッシュと長さが一致したときだけ文字列を読んで比較する
+        if (slot->hash == hash && slot->length == length
+                && memcmp(slot->string->chars, chars, length) == 0) {
+            return slot->string;
+        }
+    }
+}
+
+/// @brief 縮めた配列の容量を得る．縮めた後にすぐ大きくしないように，最大の負荷の半分に収まる容量にする
+/// @param count 要素の個数
+/// @return 2の冪の容量
+static int fitting_capacity(int count) {
+    int capacity = STRING_SET_MIN_CAPACITY;
+    while (count > capacity * (STRING_SET_MAX_LOAD / 2)) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void string_set_add(StringSet* set, ObjString* string) {
+    if (set->count + 1 > set->capacity * STRING_SET_MAX_LOAD) {
+        adjust_capacity(set, GROW_CAPACITY(set->capacity));
+    } else if (set->capacity > STRING_SET_MIN_CAPACITY && set->count < set->capacity * STRING_SET_MIN_LOAD) {
+        // GCで多くの文字列が取り除かれた後．GC中には割り当てられないので，ここで縮める
+        adjust_capacity(set, fitting_capacity(set->count + 1));
+    }
+
+    StringSlot slot = {string->hash, string->length, string};
+    insert_slot(set->slots, set->capacity, slot);
+    set->count += 1;
+}
+
+void string_set_remove(StringSet* set, ObjString* string) {
+    if (set->count == 0) {
+        return;
+    }
+
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    for (uint32_t index = string->hash & mask; ; index = (index + 1) & mask) {
+        if (set->slots[index].string == NULL) {
+            return;
+        }
+        if (set->slots[index].string == string) {
+            remove_slot(set, index);
+            return;
+        }
+    }
+}
+
+void string_set_remove_white(StringSet* set) {
+    // 詰めて移ってきた要素も調べ直すので，同じ位置を白色の文字列がなくなるまで調べる．
+    // 配列の先頭に巡回して詰める要素は調べ終えた黒色のものなので，もう一度調べなくてよい
+    for (int i = 0; i < set->capacity; i++) {
+        while (set->slots[i].string != NULL && !is_marked(&set->slots[i].string->obj)) {
+            remove_slot(set, (uint32_t)i);
+        }
+    }
+}
+
+void forward_string_set(StringSet* set) {
+    for (int i = 0; i < set->capacity; i++) {
+        StringSlot* slot = &set->slots[i];
+        slot->string = (ObjString*)heap_forward((Obj*)slot->string);
+    }
+}
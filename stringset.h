@@ -0,0 +1,66 @@
+/*
+インターン化された文字列の集合．ハッシュと長さを要素に並べて置き，探索の候補の多くを文字列を読まずに外す
+*/
+
+#ifndef CLOX_STRINGSET_H
+#define CLOX_STRINGSET_H
+
+#include "common.h"
+#include "value.h"
+
+/// @brief 文字列の集合の要素
+typedef struct {
+    /// @brief 文字列のハッシュ
+    uint32_t hash;
+    /// @brief 文字列の長さ
+    int length;
+    /// @brief 文字列．NULLなら空き
+    ObjString* string;
+} StringSlot;
+
+/// @brief 文字列の集合（線形探索のハッシュ表．削除では後ろの要素を詰めるので墓標を使わない）
+typedef struct {
+    /// @brief 要素の個数
+    int count;
+    /// @brief 配列の容量
+    int capacity;
+    /// @brief 配列
+    StringSlot* slots;
+} StringSet;
+
+/// @brief 文字列の集合を初期化する
+/// @param set 初期化される集合
+void init_string_set(StringSet* set);
+
+/// @brief 文字列の集合を解放する
+/// @param set 解放される集合
+void free_string_set(StringSet* set);
+
+/// @brief 同じ文字を持つ文字列を探す
+/// @param set 集合
+/// @param chars 文字
+/// @param length 文字数
+/// @param hash 文字のハッシュ
+/// @return 見つかった文字列．なければNULL
+ObjString* string_set_find(StringSet* set, const char* chars, int length, uint32_t hash);
+
+/// @brief 文字列を加える．同じ文字を持つ文字列がまだないこと．
+/// GCで要素が少なくなっていれば，ここで配列を縮める
+/// @param set 集合
+/// @param string 加える文字列
+void string_set_add(StringSet* set, ObjString* string);
+
+/// @brief 文字列を取り除く
+/// @param set 集合
+/// @param string 取り除く文字列．なければ何もしない
+void string_set_remove(StringSet* set, ObjString* string);
+
+/// @brief 白色（到達不可能）の文字列を全て取り除く
+/// @param set 集合
+void string_set_remove_white(StringSet* set);
+
+/// @brief コンパクションで移された文字列への参照を，移動先を指すように書き換える
+/// @param set 書き換える集合
+void forward_string_set(StringSet* set);
+
+#endif
@@ -6,57 +6,278 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// TABLE_NO_SIMDはcommon.hで定義するので，その後で判定する
+#if defined(__SSE2__) && !defined(TABLE_NO_SIMD)
+#include <emmintrin.h>
+#endif
+
+#define TABLE_MAX_LOAD 0.875
+
+// 作り直した表の負荷の上限．墓標で満杯になったとき，使用中のエントリがこの割合に収まれば拡大せずに作り直す
+#define TABLE_REHASH_LOAD 0.5
+
+// 削除で使用中のエントリがこの割合を下回ったら配列を縮める
+#define TABLE_MIN_LOAD 0.125
+
+// 最初に割り当てるエントリの配列の容量
+#define TABLE_MIN_CAPACITY 8
+
+// 制御バイトをまとめて調べるグループの大きさ
+#define GROUP_SIZE 16
+
+// 制御バイトの値．使用中のエントリはハッシュの下位7ビット（0から127）を持つ．
+// 容量がグループより小さい表では，エントリのないグループの残りも空きにしておく（キーを置くときはマスクで除く）
+// 一度も使われていない
+#define CONTROL_EMPTY ((uint8_t)0x80)
+// 削除された（墓標）
+#define CONTROL_DELETED ((uint8_t)0xFE)
+
+/// @brief 制御バイトの配列の長さを得る．小さい表でも1グループ分は確保する
+/// @param capacity エントリの配列の容量（2の冪）
+/// @return
+static inline int control_length(int capacity) {
+    return ((capacity - 1) | (GROUP_SIZE - 1)) + 1;
+}
+
+/// @brief 制御バイトの配列を得る．小さい表では制御バイトと先頭のエントリが同じキャッシュラインに載るように，
+/// エントリの配列の直前に置く
+/// @param table
+/// @return
+static inline uint8_t* table_control(Table* table) {
+    return (uint8_t*)table->entries - control_length(table->capacity);
+}
+
+/// @brief エントリと制御バイトを合わせたバイト数を得る
+/// @param capacity エントリの配列の容量
+/// @return
+static inline size_t table_bytes(int capacity) {
+    return sizeof(Entry) * capacity + control_length(capacity);
+}
+
+/// @brief グループの中で実際のエントリに対応する位置のビットマスクを得る
+/// @param capacity エントリの配列の容量
+/// @return
+static inline uint32_t group_valid_mask(int capacity) {
+    return capacity < GROUP_SIZE ? (1u << capacity) - 1 : 0xFFFF;
+}
+
+#if defined(__SSE2__) && !defined(TABLE_NO_SIMD)
+
+/// @brief グループの中で指定した制御バイトを持つ位置のビットマスクを得る
+/// @param group グループの先頭
+/// @param control 探す制御バイト
+/// @return
+static inline uint32_t match_byte(const uint8_t* group, uint8_t control) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+}
+
+/// @brief グループの中で使用中でない（空か墓標）位置のビットマスクを得る
+/// @param group グループの先頭
+/// @return
+static inline uint32_t match_unused(const uint8_t* group) {
+    // 使用中の制御バイトだけが最上位ビットを持たない
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+static inline uint32_t match_byte(const uint8_t* group, uint8_t control) {
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (uint32_t)(group[i] == control) << i;
+    }
+    return mask;
+}
+
+static inline uint32_t match_unused(const uint8_t* group) {
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+}
+
+#endif
+
+/// @brief ハッシュからグループの探索を始める位置を得る．下位7ビットは制御バイトに使うので残りを使う
+/// @param hash
+/// @param group_mask グループの数 - 1
+/// @return
+static inline uint32_t first_group(uint32_t hash, uint32_t group_mask) {
+    return (hash >> 7) & group_mask;
+}
+
+/// @brief キーを優先して置く，最初のグループの中の位置を得る．グループや制御バイトに使わない上位4ビットを使う
+/// @param hash
+/// @param capacity エントリの配列の容量
+/// @return
+static inline uint32_t home_slot(uint32_t hash, int capacity) {
+    // 容量は2の冪なので，グループより小さい表では容量 - 1，それ以外では15になる
+    return (hash >> 28) & (uint32_t)(capacity - 1) & (GROUP_SIZE - 1);
+}
+
+/// @brief グループの数 - 1を得る．グループの数は2の冪
+/// @param capacity エントリの配列の容量
+/// @return
+static inline uint32_t group_mask_of(int capacity) {
+    // 容量は2の冪なので，グループより小さい表でも分岐せずに0になる
+    return (uint32_t)(capacity - 1) / GROUP_SIZE;
+}
+
+/// @brief 作り直した表に置く容量を得る．作り直した後にすぐ作り直さないように，負荷に余裕を残す
+/// @param count 置くエントリの個数
+/// @return 2の冪の容量
+static int fitting_capacity(int count) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while (count > capacity * TABLE_REHASH_LOAD) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+uint32_t hash_value_key(Value key) {
+    #ifdef NAN_BOXING
+    uint64_t bits = key;
+    #else
+    uint64_t bits = (uint64_t)key.type << 56;
+    if (IS_OBJ(key)) {
+        bits ^= (uint64_t)(uintptr_t)AS_OBJ(key);
+    } else if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        uint64_t number_bits;
+        memcpy(&number_bits, &number, sizeof(number_bits));
+        bits ^= number_bits;
+    } else if (IS_BOOL(key)) {
+        bits ^= AS_BOOL(key);
+    }
+    #endif
+
+    // splitmix64の仕上げで全てのビットを混ぜる．制御バイトやグループには下位と上位のビットを使う
+    bits ^= bits >> 30;
+    bits *= 0xbf58476d1ce4e5b9ull;
+    bits ^= bits >> 27;
+    bits *= 0x94d049bb133111ebull;
+    bits ^= bits >> 31;
+    return (uint32_t)bits;
+}
+
+/// @brief キーのハッシュを得る．文字列は自分のハッシュを持っている
+/// @param key nilでないキー
+/// @return
+static inline uint32_t key_hash(Value key) {
+    return IS_STRING(key) ? AS_STRING(key)->hash : hash_value_key(key);
+}
+
+/// @brief 2つのキーが同じかどうかを判定する．キーは正規化してあるので，ビットが等しいかどうかだけを見る
+/// @param a
+/// @param b
+/// @return
+static inline bool same_key(Value a, Value b) {
+    #ifdef NAN_BOXING
+    return a == b;
+    #else
+    if (a.type != b.type) {
+        return false;
+    }
+    if (IS_OBJ(a)) {
+        return AS_OBJ(a) == AS_OBJ(b);
+    }
+    if (IS_NUMBER(a)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return !IS_BOOL(a) || AS_BOOL(a) == AS_BOOL(b);
+    #endif
+}
 
 void init_table(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
 }
 
 void free_table(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->entries != NULL) {
+        FREE_ARRAY(uint8_t, table_control(table), table_bytes(table->capacity));
+    }
     init_table(table);
 }
 
-/// @brief ハッシュ表でエントリを探す
-/// @param entries エントリの配列
-/// @param capacity エントリの配列の容量
+/// @brief ハッシュ表でキーのエントリを探す．制御バイトを1グループずつまとめて比べ，
+/// ハッシュの下位7ビットが一致したエントリだけキーを読む
+/// @param table
 /// @param key 対象のキー
-/// @return 
-static Entry* find_entry(Entry* entries, int capacity, ObjString* key) {
-    // uint32_t index = key->hash % capacity;
-    uint32_t index = key->hash & (capacity - 1);
-
-    Entry* tombstone = NULL; // 墓標
-
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // 空
-                return tombstone != NULL ? tombstone : entry;
-            } else if (tombstone == NULL) {
-                // 墓標
-                tombstone = entry;
+/// @param hash キーのハッシュ
+/// @return 見つかったエントリ．なければNULL
+static inline Entry* find_entry(Table* table, Value key, uint32_t hash) {
+    uint32_t group_mask = group_mask_of(table->capacity);
+    uint32_t group = first_group(hash, group_mask);
+
+    // ほとんどのキーは優先する位置にあるので，制御バイトを読まずに確かめる
+    Entry* home = &table->entries[group * GROUP_SIZE + home_slot(hash, table->capacity)];
+    if (same_key(home->key, key)) {
+        return home;
+    }
+
+    uint8_t* control = table_control(table);
+    uint8_t fragment = hash & 0x7F;
+
+    // グループを三角数の間隔でたどる．グループの数が2の冪なので全てのグループを一度ずつ訪れる
+    for (uint32_t step = 1; ; step++) {
+        const uint8_t* group_control = control + group * GROUP_SIZE;
+        for (uint32_t matches = match_byte(group_control, fragment); matches != 0; matches &= matches - 1) {
+            Entry* entry = &table->entries[group * GROUP_SIZE + __builtin_ctz(matches)];
+            if (same_key(entry->key, key)) {
+                return entry;
             }
-        } else if (entry->key == key) {
-            // キー
-            return entry;
         }
+        // 空きのあるグループより先には，このキーが置かれることはない
+        if (match_byte(group_control, CONTROL_EMPTY) != 0) {
+            return NULL;
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+/// @brief キーを置く位置（空きか墓標）を探す．キーが表にないこと
+/// @param control 制御バイトの配列
+/// @param capacity エントリの配列の容量
+/// @param hash キーのハッシュ
+/// @return エントリの位置
+static int find_insert_slot(const uint8_t* control, int capacity, uint32_t hash) {
+    uint32_t group_mask = group_mask_of(capacity);
+    uint32_t valid = group_valid_mask(capacity);
+    uint32_t group = first_group(hash, group_mask);
+
+    // 最初のグループの優先する位置が空いていれば，そこに置く
+    uint32_t home = group * GROUP_SIZE + home_slot(hash, capacity);
+    if (control[home] & 0x80) {
+        return (int)home;
+    }
 
-        // index = (index + 1) % capacity;
-        index = (index + 1) & (capacity - 1);
+    for (uint32_t step = 1; ; step++) {
+        uint32_t unused = match_unused(control + group * GROUP_SIZE) & valid;
+        if (unused != 0) {
+            return (int)(group * GROUP_SIZE + __builtin_ctz(unused));
+        }
+        group = (group + step) & group_mask;
     }
 }
 
-bool table_get(Table* table, ObjString* key, Value* value) {
+/// @brief キーを探索する
+/// @param table
+/// @param key
+/// @param hash キーのハッシュ
+/// @param value 見つかった場合は，その値を格納する
+/// @return 見つかったかどうか
+static inline bool get_entry(Table* table, Value key, uint32_t hash, Value* value) {
     if (table->count == 0) {
         return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    Entry* entry = find_entry(table, key, hash);
+    if (entry == NULL) {
         return false;
     }
 
@@ -64,126 +285,235 @@ bool table_get(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
-/// @brief ハッシュ表のバケット配列を作成して初期化する
-/// @param table 
-/// @param capacity 
+/// @brief ハッシュ表のエントリと制御バイトの配列を作成して，使用中のエントリを入れ直す
+/// @param table
+/// @param capacity
 static void adjust_capacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    uint8_t* control = ALLOCATE(uint8_t, table_bytes(capacity));
+    Entry* entries = (Entry*)(control + control_length(capacity));
 
     for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
+        entries[i].key = NIL_VAL;
         entries[i].value = NIL_VAL;
     }
+    memset(control, CONTROL_EMPTY, control_length(capacity));
 
     table->count = 0;
+    table->tombstones = 0;
     //古い配列で，空でないパケットを新しい配列に入れる
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) {
+        if (IS_NIL(entry->key)) {
             continue;
         }
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        uint32_t hash = key_hash(entry->key);
+        int slot = find_insert_slot(control, capacity, hash);
+        control[slot] = hash & 0x7F;
+        entries[slot] = *entry;
         table->count += 1;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->entries != NULL) {
+        FREE_ARRAY(uint8_t, table_control(table), table_bytes(table->capacity));
+    }
 
     table->entries = entries;
     table->capacity = capacity;
 }
 
-bool table_set(Table* table, ObjString* key, Value value) {
-    // 容量がないときは拡大する
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+/// @brief キーと値のペアを追加する
+/// @param table
+/// @param key
+/// @param hash キーのハッシュ
+/// @param value
+/// @return 新規のエントリーかどうか
+static bool set_entry(Table* table, Value key, uint32_t hash, Value value) {
+    if (table->count > 0) {
+        Entry* entry = find_entry(table, key, hash);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key || IS_NIL(entry->value)) {
-        // 新しいキーで墓標でない
-        table->count += 1;
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // 墓標が多くて使用中のエントリが少なければ，拡大せずに同じか小さい容量で作り直して墓標を取り除く
+        int capacity = table->count + 1 <= table->capacity * TABLE_REHASH_LOAD
+            ? fitting_capacity(table->count + 1)
+            : (table->capacity == 0 ? TABLE_MIN_CAPACITY : table->capacity * 2);
+        adjust_capacity(table, capacity);
     }
 
-    entry->key = key;
-    entry->value = value;
+    int slot = find_insert_slot(table_control(table), table->capacity, hash);
+    if (table_control(table)[slot] == CONTROL_DELETED) {
+        table->tombstones -= 1;
+    }
+    table->count += 1;
 
-    return is_new_key;
+    table_control(table)[slot] = hash & 0x7F;
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    return true;
 }
 
-bool table_delete(Table* table, ObjString* key) {
+/// @brief エントリを削除する
+/// @param table
+/// @param key
+/// @param hash キーのハッシュ
+/// @return 削除したかどうか
+static bool delete_entry(Table* table, Value key, uint32_t hash) {
     if (table->count == 0) {
         return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
+    Entry* entry = find_entry(table, key, hash);
     // 見つからない場合は終わり
-    if (entry->key == NULL) {
+    if (entry == NULL) {
         return false;
     }
 
-    // 削除したという印（墓標）
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // グループに空きが残っていれば，このグループが満杯になったことはなく，
+    // ここを通り過ぎて置かれたキーもないので，墓標を残さずに空きに戻せる
+    int slot = (int)(entry - table->entries);
+    uint8_t* control = table_control(table);
+    if (match_byte(control + (slot & ~(GROUP_SIZE - 1)), CONTROL_EMPTY) != 0) {
+        control[slot] = CONTROL_EMPTY;
+    } else {
+        control[slot] = CONTROL_DELETED;
+        table->tombstones += 1;
+    }
+    entry->key = NIL_VAL;
+    entry->value = NIL_VAL;
+    table->count -= 1;
+
+    // 使用中のエントリが少なくなったら，小さい配列に作り直す
+    if (table->capacity > TABLE_MIN_CAPACITY && table->count < table->capacity * TABLE_MIN_LOAD) {
+        adjust_capacity(table, fitting_capacity(table->count));
+    }
     return true;
 }
 
+bool table_get(Table* table, ObjString* key, Value* value) {
+    return get_entry(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool table_set(Table* table, ObjString* key, Value value) {
+    return set_entry(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool table_delete(Table* table, ObjString* key) {
+    return delete_entry(table, OBJ_VAL(key), key->hash);
+}
+
+bool table_get_value(Table* table, Value key, Value* value) {
+    return get_entry(table, key, key_hash(key), value);
+}
+
+bool table_set_value(Table* table, Value key, Value value) {
+    return set_entry(table, key, key_hash(key), value);
+}
+
+bool table_delete_value(Table* table, Value key) {
+    return delete_entry(table, key, key_hash(key));
+}
+
+int table_probe_length(Table* table, Value key) {
+    if (table->count == 0) {
+        return 0;
+    }
+
+    // find_entryと同じ順でグループをたどる
+    uint32_t hash = key_hash(key);
+    uint32_t group_mask = group_mask_of(table->capacity);
+    uint32_t group = first_group(hash, group_mask);
+    uint8_t* control = table_control(table);
+    uint8_t fragment = hash & 0x7F;
+    for (uint32_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t* group_control = control + group * GROUP_SIZE;
+        for (uint32_t matches = match_byte(group_control, fragment); matches != 0; matches &= matches - 1) {
+            if (same_key(table->entries[group * GROUP_SIZE + __builtin_ctz(matches)].key, key)) {
+                return (int)step;
+            }
+        }
+        if (match_byte(group_control, CONTROL_EMPTY) != 0) {
+            return 0;
+        }
+        group = (group + step) & group_mask;
+    }
+    return 0;
+}
+
 void table_add_all(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            table_set(to, entry->key, entry->value);
+        if (!IS_NIL(entry->key)) {
+            set_entry(to, entry->key, key_hash(entry->key), entry->value);
         }
     }
 }
 
-ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash) {
-    if (table->count == 0) {
-        return NULL;
+void mark_table(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        mark_value(entry->key);
+        mark_value(entry->value);
     }
+}
 
-    // uint32_t index = hash % table->capacity;
-    uint32_t index = hash & (table->capacity - 1);
+/// @brief 同じ容量のまま，全てのエントリをその場で置き直す．墓標もなくなる．
+/// GC中は割り当てられないので，置き直す前のエントリを墓標の制御バイトで表し，入れ替えながら置いていく
+/// @param table
+static void rehash_in_place(Table* table) {
+    uint8_t* control = table_control(table);
+    for (int i = 0; i < table->capacity; i++) {
+        control[i] = (control[i] & 0x80) ? CONTROL_EMPTY : CONTROL_DELETED;
+    }
+    table->tombstones = 0;
 
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // 空を見つけたら終わり
-                return NULL;
-            }
-        } else if (
-            entry->key->length == length
-            && entry->key->hash == hash
-            && memcmp(entry->key->chars, chars, length) == 0
-        ) {
-            // ハッシュだけではなく，厳密に文字列を比較する
-            // 文字列を見つけた
-            return entry->key;
+    for (int i = 0; i < table->capacity; i++) {
+        if (control[i] != CONTROL_DELETED) {
+            continue;
+        }
+
+        uint32_t hash = key_hash(table->entries[i].key);
+        int slot = find_insert_slot(control, table->capacity, hash);
+        // 探索で最初に空きが見つかるグループにすでにあれば，動かさなくてよい
+        if (slot / GROUP_SIZE == i / GROUP_SIZE) {
+            control[i] = hash & 0x7F;
+            continue;
         }
 
-        // index = (index + 1) % table->capacity;
-        index = (index + 1) & (table->capacity - 1);
+        if (control[slot] == CONTROL_EMPTY) {
+            table->entries[slot] = table->entries[i];
+            table->entries[i].key = NIL_VAL;
+            table->entries[i].value = NIL_VAL;
+            control[i] = CONTROL_EMPTY;
+        } else {
+            // 置き直す前のエントリと入れ替え，入ってきたエントリをもう一度置き直す
+            Entry displaced = table->entries[slot];
+            table->entries[slot] = table->entries[i];
+            table->entries[i] = displaced;
+            i -= 1;
+        }
+        control[slot] = hash & 0x7F;
     }
 }
 
-void table_remove_white(Table* table) {
+void forward_table(Table* table) {
+    bool rehash = false;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked) {
-            table_delete(table, entry->key);
+        Value key = forward_value(entry->key);
+        // 文字列は自分のハッシュを持つので，移されても置き直さなくてよい
+        if (!same_key(key, entry->key) && !IS_STRING(key)) {
+            rehash = true;
         }
+        entry->key = key;
+        entry->value = forward_value(entry->value);
     }
-}
 
-void mark_table(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        mark_object((Obj*)entry->key);
-        mark_value(entry->value);
+    if (rehash) {
+        rehash_in_place(table);
     }
-}
\ No newline at end of file
+}
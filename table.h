@@ -6,17 +6,21 @@
 
 /// @brief キーと値のペア
 typedef struct {
-    ObjString* key;
+    /// @brief キー．nilなら空き
+    Value key;
     Value value;
 } Entry;
 
-/// @brief ハッシュ表
+/// @brief ハッシュ表．キーはnil以外の値で，ビットで比べる（文字列はインターン化したもの，数は正規化したもの）．
+/// エントリの配列の直前に，ハッシュの下位7ビットを入れた制御バイトの配列を置き，16個ずつまとめて探す（Swiss table）
 typedef struct {
-    /// @brief エントリの個数
+    /// @brief エントリの個数（墓標を含まない）
     int count;
+    /// @brief 墓標の個数
+    int tombstones;
     /// @brief 配列の容量
     int capacity;
-    /// @brief 配列
+    /// @brief 配列（制御バイトの配列と一緒に割り当てる）
     Entry* entries;
 } Table;
 
@@ -24,6 +28,11 @@ typedef struct {
 /// @param table 初期化されるハッシュ表
 void init_table(Table* table);
 
+/// @brief 文字列でないキーの値のハッシュを計算する．オブジェクトはアドレスから計算する
+/// @param key キー
+/// @return ハッシュ
+uint32_t hash_value_key(Value key);
+
 /// @brief ハッシュ表を開放する
 /// @param table 解放されるハッシュ表
 void free_table(Table* table);
@@ -42,31 +51,50 @@ bool table_get(Table* table, ObjString* key, Value* value);
 /// @return 新規のエントリーかどうか
 bool table_set(Table* table, ObjString* key, Value value);
 
-/// @brief エントリを削除する
+/// @brief エントリを削除する．使用中のエントリが少なくなれば配列を縮める
 /// @param table 
 /// @param key 
 /// @return 
 bool table_delete(Table* table, ObjString* key);
 
+/// @brief 任意の値のキーでハッシュ表を探索する
+/// @param table 探索するハッシュ表
+/// @param key 探索するキー．map_keyで正規化したもの
+/// @param value 見つかった場合は，その値を格納する
+/// @return 見つかったかどうか
+bool table_get_value(Table* table, Value key, Value* value);
+
+/// @brief 任意の値のキーと値のペアをハッシュ表に追加する
+/// @param table ハッシュ表
+/// @param key キー．map_keyで正規化したもの
+/// @param value 値
+/// @return 新規のエントリーかどうか
+bool table_set_value(Table* table, Value key, Value value);
+
+/// @brief 任意の値のキーのエントリを削除する
+/// @param table 
+/// @param key キー．map_keyで正規化したもの
+/// @return 削除したかどうか
+bool table_delete_value(Table* table, Value key);
+
+/// @brief キーを見つけるまでに調べる制御バイトのグループの数を得る．探索の長さを確かめるのに使う
+/// @param table ハッシュ表
+/// @param key 探すキー．map_keyで正規化したもの
+/// @return グループの数（最初のグループで見つかれば1）．キーがなければ0
+int table_probe_length(Table* table, Value key);
+
 /// @brief ハッシュ表をコピーする
 /// @param from コピー元
 /// @param to コピー先
 void table_add_all(Table* from, Table* to);
 
-/// @brief ハッシュ表にある文字列を探索する
-/// @param table 文字列を追加するテーブル
-/// @param chars 追加されるC文字列
-/// @param length 文字列の長さ
-/// @param hash 文字列のハッシュ
-/// @return 
-ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
-
-/// @brief 文字列表から白色（到達不可能）のものを削除する
-/// @param table 対象のテーブル
-void table_remove_white(Table* table);
-
 /// @brief 表にある全てのオブジェクトにマークをつける
 /// @param table マークする表
 void mark_table(Table* table);
 
+/// @brief コンパクションで移されたオブジェクトへの参照を，移動先を指すように書き換える．
+/// アドレスでハッシュしたキーが移されていれば，同じ容量のまま置き直す
+/// @param table 書き換える表
+void forward_table(Table* table);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+/*
+ハッシュ表（Swiss table）と文字列の集合の探索の長さを確かめるテスト．
+挿入と削除を繰り返した後と，コンパクションでキーが移されて表をその場で置き直した後に，
+キーを見つけるまでに調べる長さの最大と平均が上限に収まることを確かめる
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "stringset.h"
+#include "table.h"
+#include "vm.h"
+
+// 挿入と削除を繰り返すときに，表に残しておくキーの数
+#define CHURN_LIVE 1000
+// 挿入と削除を繰り返す回数
+#define CHURN_STEPS 100000
+// コンパクションの前に作るインスタンスの数．4つに1つをキーとして残す
+#define COMPACT_INSTANCES 60000
+
+// Swiss tableの探索の長さ（グループの数）の上限
+#define TABLE_MAX_PROBES 4
+#define TABLE_MEAN_PROBES 1.1
+// 文字列の集合の探索の長さ（要素の数）の上限．線形探索なので負荷に応じて長くなる
+#define STRING_SET_MAX_PROBES 48
+#define STRING_SET_MEAN_PROBES 3.0
+
+/// @brief 失敗した確認の数
+static int failures = 0;
+
+/// @brief 探索の長さの統計
+typedef struct {
+    /// @brief 調べたキーの数
+    int count;
+    /// @brief 見つからなかったキーの数
+    int missing;
+    /// @brief 最大の長さ
+    int max;
+    /// @brief 平均の長さ
+    double mean;
+} ProbeStats;
+
+/// @brief 表にある全てのキーについて，探索で調べるグループの数を集計する
+/// @param table ハッシュ表
+/// @return 統計
+static ProbeStats table_probe_stats(Table* table) {
+    ProbeStats stats = {0, 0, 0, 0};
+    long total = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        Value key = table->entries[i].key;
+        if (IS_NIL(key)) {
+            continue;
+        }
+        int length = table_probe_length(table, key);
+        if (length == 0) {
+            stats.missing += 1;
+            continue;
+        }
+        stats.count += 1;
+        total += length;
+        if (length > stats.max) {
+            stats.max = length;
+        }
+    }
+    stats.mean = stats.count == 0 ? 0 : (double)total / stats.count;
+    return stats;
+}
+
+/// @brief 集合にある全ての文字列について，探索で調べる要素の数を集計する
+/// @param set 文字列の集合
+/// @return 統計
+static ProbeStats string_set_probe_stats(StringSet* set) {
+    ProbeStats stats = {0, 0, 0, 0};
+    long total = 0;
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    for (int i = 0; i < set->capacity; i++) {
+        StringSlot* slot = &set->slots[i];
+        if (slot->string == NULL) {
+            continue;
+        }
+        // 本来の位置からこの位置までの間に空きがあれば，探索はここまで届かない
+        uint32_t home = slot->hash & mask;
+        for (uint32_t index = home; index != (uint32_t)i; index = (index + 1) & mask) {
+            if (set->slots[index].string == NULL) {
+                stats.missing += 1;
+                break;
+            }
+        }
+        int length = (int)(((uint32_t)i - home) & mask) + 1;
+        stats.count += 1;
+        total += length;
+        if (length > stats.max) {
+            stats.max = length;
+        }
+    }
+    stats.mean = stats.count == 0 ? 0 : (double)total / stats.count;
+    return stats;
+}
+
+/// @brief 統計が上限に収まっているかどうかを確かめて報告する
+/// @param name 確かめる表の名前
+/// @param stats 統計
+/// @param max_limit 最大の長さの上限
+/// @param mean_limit 平均の長さの上限
+static void check_stats(const char* name, ProbeStats stats, int max_limit, double mean_limit) {
+    bool ok = stats.missing == 0 && stats.count > 0 && stats.max <= max_limit && stats.mean <= mean_limit;
+    printf("%s %s: %d keys, %d missing, max %d (limit %d), mean %.3f (limit %.2f)\n",
+        ok ? "ok  " : "FAIL", name, stats.count, stats.missing, stats.max, max_limit, stats.mean, mean_limit);
+    if (!ok) {
+        failures += 1;
+    }
+}
+
+/// @brief 条件を確かめて報告する
+/// @param ok 条件
+/// @param message 条件の説明
+static void check(bool ok, const char* message) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", message);
+    if (!ok) {
+        failures += 1;
+    }
+}
+
+/// @brief 数のキーで挿入と削除を繰り返した後の表を確かめる
+static void test_number_churn() {
+    push(OBJ_VAL(new_map()));
+    ObjMap* map = AS_MAP(vm.stack_top[-1]);
+    for (int i = 0; i < CHURN_STEPS; i++) {
+        map_set(map, NUMBER_VAL(i), NUMBER_VAL(i));
+        if (i >= CHURN_LIVE) {
+            map_delete(map, NUMBER_VAL(i - CHURN_LIVE));
+        }
+    }
+    check_stats("table with number keys after churn", table_probe_stats(&map->table),
+        TABLE_MAX_PROBES, TABLE_MEAN_PROBES);
+    pop();
+}
+
+/// @brief 文字列のキーで挿入と削除を繰り返した後の表と，文字列の集合を確かめる
+static void test_string_churn() {
+    push(OBJ_VAL(new_map()));
+    for (int i = 0; i < CHURN_STEPS; i++) {
+        char chars[32];
+        int length = snprintf(chars, sizeof(chars), "key%d", i);
+        // インターン化した文字列はすぐに表に置くので，割り当てでGCが走っても消えない
+        ObjString* key = copy_string(chars, length);
+        map_set(AS_MAP(vm.stack_top[-1]), OBJ_VAL(key), NUMBER_VAL(i));
+        if (i >= CHURN_LIVE) {
+            length = snprintf(chars, sizeof(chars), "key%d", i - CHURN_LIVE);
+            ObjString* old = copy_string(chars, length);
+            map_delete(AS_MAP(vm.stack_top[-1]), OBJ_VAL(old));
+        }
+    }
+    check_stats("table with string keys after churn", table_probe_stats(&AS_MAP(vm.stack_top[-1])->table),
+        TABLE_MAX_PROBES, TABLE_MEAN_PROBES);
+
+    // 取り除いたキーの文字列をGCで集合から取り除いてから調べる
+    collect_garbage();
+    finish_gc_cycle();
+    check_stats("string set after churn", string_set_probe_stats(&vm.strings),
+        STRING_SET_MAX_PROBES, STRING_SET_MEAN_PROBES);
+    pop();
+}
+
+/// @brief アドレスを比べる
+static int compare_addresses(const void* a, const void* b) {
+    uintptr_t x = *(const uintptr_t*)a;
+    uintptr_t y = *(const uintptr_t*)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief インスタンスのキーを散らばったページに置き，削除で穴を開けてからコンパクションで移し，
+/// その場で置き直した表（rehash_in_place）を確かめる
+static void test_compact_rehash() {
+    ObjString* name = copy_string("Key", 3);
+    push(OBJ_VAL(name));
+    push(OBJ_VAL(new_class(name)));
+    push(OBJ_VAL(new_map()));
+    ObjClass* class_ = AS_CLASS(vm.stack_top[-2]);
+
+    // 4つに1つだけをキーとして残し，残りはごみにしてページを疎にする
+    for (int i = 0; i < COMPACT_INSTANCES; i++) {
+        ObjInstance* instance = new_instance(class_);
+        if (i % 4 == 0) {
+            map_set(AS_MAP(vm.stack_top[-1]), OBJ_VAL(instance), NUMBER_VAL(i));
+        }
+    }
+    // キーの半分を削除して，墓標と空きを混ぜる
+    Table* table = &AS_MAP(vm.stack_top[-1])->table;
+    bool drop = false;
+    for (int i = 0; i < table->capacity; i++) {
+        Value key = table->entries[i].key;
+        if (!IS_NIL(key)) {
+            if (drop) {
+                map_delete(AS_MAP(vm.stack_top[-1]), key);
+            }
+            drop = !drop;
+        }
+    }
+
+    // コンパクションの前のキーのアドレスを覚えておく
+    int count = table->count;
+    uintptr_t* before = malloc(sizeof(uintptr_t) * count);
+    int n = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (!IS_NIL(table->entries[i].key)) {
+            before[n++] = (uintptr_t)AS_OBJ(table->entries[i].key);
+        }
+    }
+    qsort(before, n, sizeof(uintptr_t), compare_addresses);
+
+    collect_garbage();
+    finish_gc_cycle();
+    compact_heap();
+
+    // マップ自体も移されているかもしれないので，スタックから読み直す
+    table = &AS_MAP(vm.stack_top[-1])->table;
+    int moved = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(table->entries[i].key)) {
+            continue;
+        }
+        uintptr_t address = (uintptr_t)AS_OBJ(table->entries[i].key);
+        if (bsearch(&address, before, n, sizeof(uintptr_t), compare_addresses) == NULL) {
+            moved += 1;
+        }
+    }
+    free(before);
+
+    check(table->count == count, "compaction keeps every key");
+    check(moved > 0, "compaction moves instance keys");
+    check(table->tombstones == 0, "rehash in place clears tombstones");
+    check_stats("table after compaction", table_probe_stats(table), TABLE_MAX_PROBES, TABLE_MEAN_PROBES);
+    pop();
+    pop();
+    pop();
+}
+
+int main() {
+    init_vm();
+    test_number_churn();
+    test_string_churn();
+    test_compact_rehash();
+    free_vm();
+
+    printf("probe: %s\n", failures == 0 ? "all passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# tests/lox/*.loxをGCの各モードで実行し，期待する出力（同じ名前の.expected）と比べる．
+# 出力は，標準出力（DEBUG_PRINT_CODEの逆アセンブルを除く），標準エラー出力，終了コードの順につなげたもの
+#
+# 使い方: tests/run_lox.sh [インタプリタ] [--update]
+#   --update  既定のモードの出力で.expectedを書き直す
+
+CLOX=./a.out
+UPDATE=0
+for arg in "$@"; do
+    case "$arg" in
+        --update) UPDATE=1 ;;
+        *) CLOX=$arg ;;
+    esac
+done
+
+DIR=$(dirname "$0")/lox
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# 既定のモードに加えて，インクリメンタル，並行，並列のマークと，コンパクションで実行する
+MODES="default --gc-incremental --gc-concurrent --gc-threads=4 --gc-compact"
+
+# スクリプトを実行して，比べる形の出力を書く
+run() {
+    flags=$1
+    script=$2
+    [ "$flags" = default ] && flags=
+    # shellcheck disable=SC2086
+    timeout 300 "$CLOX" $flags "$script" >"$TMP/stdout" 2>"$TMP/stderr"
+    status=$?
+    grep -v -E '^(== .* ==|[0-9]{4} )' "$TMP/stdout"
+    cat "$TMP/stderr"
+    echo "exit=$status"
+}
+
+passed=0
+failed=0
+for script in "$DIR"/*.lox; do
+    expected=${script%.lox}.expected
+    if [ $UPDATE = 1 ]; then
+        run default "$script" >"$expected"
+        continue
+    fi
+    for mode in $MODES; do
+        run "$mode" "$script" >"$TMP/actual"
+        if diff "$expected" "$TMP/actual" >"$TMP/diff"; then
+            passed=$((passed + 1))
+        else
+            failed=$((failed + 1))
+            echo "FAIL $(basename "$script") ($mode)"
+            head -20 "$TMP/diff"
+        fi
+    done
+done
+
+[ $UPDATE = 1 ] && exit 0
+echo "lox: $passed passed, $failed failed"
+[ $failed = 0 ]
@@ -14,8 +14,9 @@ void init_value_array(ValueArray* array) {
 void write_value_array(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        int capacity = GROW_CAPACITY(old_capacity);
+        array->values = GROW_ARRAY(Value, array->values, old_capacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -35,6 +36,10 @@ void print_value(Value value) {
             printf("nil");
         } else if (IS_NUMBER(value)) {
             printf("%g", AS_NUMBER(value));
+        } else if (IS_SHORT_STRING(value)) {
+            char chars[SHORT_STRING_MAX];
+            int length = short_string_chars(value, chars);
+            printf("%.*s", length, chars);
         } else if (IS_OBJ(value)) {
             print_object(value);
         }
@@ -62,7 +67,12 @@ bool values_equal(Value a, Value b) {
         // NaN判定のためにdoubleで判定する
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) {
+        return true;
+    }
+    // 短い文字列はビットが等しいときだけ等しい（それより長い文字列は文字列オブジェクトになっている）．
+    // インターン化されていない文字列は，同じ文字でも別のオブジェクトになっている
+    return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
     #else
     if (a.type != b.type) {
         return false;
@@ -72,7 +82,9 @@ bool values_equal(Value a, Value b) {
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b)
+                || (IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b)));
         default: return false; // unreachable
     }
     #endif
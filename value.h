@@ -21,14 +21,30 @@ typedef struct ObjString ObjString;
 #define TAG_FALSE 2
 #define TAG_TRUE 3
 
+// 32ビット整数のタグ．quiet NaNのペイロードの上位のビットに置き，下位32ビットに整数を入れる．
+// 整数もnumberで，doubleの値と区別できないように扱う
+#define TAG_INT ((uint64_t)0x0001000000000000)
+
+// 短い文字列のタグ．SHORT_STRING_MAX文字までの文字列を，下位40ビットの文字（1文字8ビット）と，
+// その上の3ビットの長さでペイロードに埋め込む．使わない文字のビットは0にしておくので，ビットが等しければ同じ文字列
+#define TAG_SHORT_STRING ((uint64_t)0x0002000000000000)
+#define SHORT_STRING_MAX 5
+
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+// 2つの値がどちらも整数かどうかを，分岐1つで判定する
+#define IS_INT_PAIR(a, b) \
+    (((((a) & (SIGN_BIT | QNAN | TAG_INT)) ^ (QNAN | TAG_INT)) \
+        | (((b) & (SIGN_BIT | QNAN | TAG_INT)) ^ (QNAN | TAG_INT))) == 0)
+#define IS_SHORT_STRING(value) (((value) & (SIGN_BIT | QNAN | TAG_SHORT_STRING)) == (QNAN | TAG_SHORT_STRING))
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN || IS_INT(value))
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
 #define AS_NUMBER(value) value_to_num(value)
 #define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -36,10 +52,15 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define INT_VAL(i) ((Value)(QNAN | TAG_INT | (uint64_t)(uint32_t)(i)))
 #define NUMBER_VAL(num) num_to_value(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline double value_to_num(Value value) {
+    if (IS_INT(value)) {
+        return (double)AS_INT(value);
+    }
+
     // double num;
     // memcpy(&num, &value, sizeof(Value));
     // return num;
@@ -70,6 +91,37 @@ static inline Value num_to_value(double num) {
     return data.bits;
 }
 
+/// @brief 短い文字列を作る
+/// @param chars 文字
+/// @param length 文字数．SHORT_STRING_MAX以下
+/// @return 
+static inline Value short_string_val(const char* chars, int length) {
+    uint64_t bits = QNAN | TAG_SHORT_STRING | ((uint64_t)length << 40);
+    for (int i = 0; i < length; i++) {
+        bits |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+    }
+    return bits;
+}
+
+/// @brief 短い文字列の文字数を得る
+/// @param value 短い文字列
+/// @return 
+static inline int short_string_length(Value value) {
+    return (int)((value >> 40) & 0x7);
+}
+
+/// @brief 短い文字列の文字を書き出す（終端の'\0'は書かない）
+/// @param value 短い文字列
+/// @param chars 書き出す先．SHORT_STRING_MAX文字分あること
+/// @return 文字数
+static inline int short_string_chars(Value value, char* chars) {
+    int length = short_string_length(value);
+    for (int i = 0; i < length && i < SHORT_STRING_MAX; i++) {
+        chars[i] = (char)(value >> (8 * i));
+    }
+    return length;
+}
+
 #else
 
 /// @brief VMが組み込みでサポートする型の種類
@@ -98,6 +150,12 @@ typedef struct {
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 // Valueがbooleanかどうかを判定する
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
+// 整数のタグはNaN boxingでだけ使うので，numberは常にdoubleで持つ
+#define IS_INT(value) false
+#define IS_INT_PAIR(a, b) false
+// 短い文字列もNaN boxingでだけ使うので，文字列は常にオブジェクトで持つ
+#define IS_SHORT_STRING(value) false
+#define SHORT_STRING_MAX 0
 
 // ValueからObjへのポインタを生成する
 #define AS_OBJ(value) ((value).as.obj)
@@ -105,6 +163,8 @@ typedef struct {
 #define AS_BOOL(value) ((value).as.boolean)
 // ValueからC言語のdoubleを生成する
 #define AS_NUMBER(value) ((value).as.number)
+// Valueから整数を生成する（IS_INTが偽なので使われない）
+#define AS_INT(value) ((int32_t)(value).as.number)
 
 
 // Cの値をLoxのbooleanに変換する
@@ -113,6 +173,17 @@ typedef struct {
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 // Cの値をLoxのnumberに変換する
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+// Cの整数をLoxのnumberに変換する
+#define INT_VAL(value) NUMBER_VAL((double)(value))
+
+// 短い文字列の文字数と文字を得る（IS_SHORT_STRINGが偽なので使われない）
+static inline int short_string_length(Value value) {
+    return 0;
+}
+
+static inline int short_string_chars(Value value, char* chars) {
+    return 0;
+}
 // ObjへのポインタをLoxオブジェクトに変換する
 #define OBJ_VAL(object) ((Value) {VAL_OBJ, {.obj = (Obj*) object}})
 
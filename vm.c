@@ -1,22 +1,377 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
 #include <time.h>
 #include <stdarg.h>
 #include <string.h>
 
 #include "common.h"
 #include "debug.h"
+#include "floatkernels.h"
+#include "gcstats.h"
 #include "object.h"
 #include "memory.h"
+#include "pool.h"
 #include "vm.h"
 #include "compiler.h"
 
 /// @brief 唯一の仮想マシン
 Vm vm;
 
+/// @brief ネイティブ関数が報告したエラーのメッセージ．エラーがなければNULL
+static const char* native_error_message = NULL;
+
+/// @brief ネイティブ関数からランタイムエラーを報告する．呼び出したcall_nativeがエラーとして扱う
+/// @param message エラーのメッセージ
+/// @return ネイティブ関数が代わりに返すnil
+static Value native_error(const char* message) {
+    native_error_message = message;
+    return NIL_VAL;
+}
+
 static Value clock_native(int arg_count, Value* args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+/// @brief これまでのGCによる最大の停止時間を返す
+static Value gc_max_pause_native(int arg_count, Value* args) {
+    return NUMBER_VAL((double)vm.gc_max_pause / 1e9);
+}
+
+/// @brief GCと割り当ての統計を名前で読む
+/// @param arg_count 1
+/// @param args 統計の名前（"collections.full"など）
+/// @return 統計の値．名前が見つからなければnil
+static Value gc_stat_native(int arg_count, Value* args) {
+    if (!IS_STRING(args[0])) {
+        return native_error("Statistic name must be a string.");
+    }
+    double value;
+    if (!find_gc_stat(AS_CSTRING(args[0]), &value)) {
+        return NIL_VAL;
+    }
+    return NUMBER_VAL(value);
+}
+
+/// @brief 空の文字列ビルダーを作る
+/// @return 新しい文字列ビルダー
+static Value string_builder_native(int arg_count, Value* args) {
+    return OBJ_VAL(new_string_builder());
+}
+
+/// @brief 文字列ビルダーに値を追記する．数はprintと同じ書式で書く（builder.append(...)）
+/// @param arg_count 1以上
+/// @param args 文字列ビルダーと，追記する文字列か数（いくつでもよい）
+/// @return 文字列ビルダー．引数が正しくなければ何も追記しない
+static Value append_native(int arg_count, Value* args) {
+    for (int i = 1; i < arg_count; i++) {
+        if (!is_text(args[i]) && !IS_NUMBER(args[i])) {
+            return native_error("Can only append strings and numbers.");
+        }
+    }
+
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+    for (int i = 1; i < arg_count; i++) {
+        if (IS_NUMBER(args[i])) {
+            char buffer[32];
+            int length = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(args[i]));
+            string_builder_append(builder, buffer, length);
+        } else {
+            string_builder_append_text(builder, args[i]);
+        }
+    }
+    return args[0];
+}
+
+/// @brief 文字列ビルダーの内容を文字列にする（builder.toString()）
+/// @param arg_count 1
+/// @param args 文字列ビルダー
+/// @return 新しい文字列
+static Value to_string_native(int arg_count, Value* args) {
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+    if (builder->length == 0) {
+        return string_value("", 0);
+    }
+    return runtime_string_value(builder->chars, builder->length);
+}
+
+/// @brief 文字列ビルダーの内容を文字列を作らずに標準出力へ書き出し，空にする（容量はそのまま）（builder.flush()）
+/// @param arg_count 1
+/// @param args 文字列ビルダー
+/// @return nil
+static Value flush_native(int arg_count, Value* args) {
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+    fwrite(builder->chars, 1, builder->length, stdout);
+    builder->length = 0;
+    return NIL_VAL;
+}
+
+/// @brief 値をリストや配列の位置に変換する．整数の値だけが位置になる
+/// @param value 位置の値
+/// @param limit 位置の上限（これは含まない）
+/// @param index 変換した位置を格納する
+/// @return 0以上limit未満の整数だったかどうか
+static bool to_index(Value value, int limit, int* index) {
+    if (IS_INT(value)) {
+        *index = AS_INT(value);
+        return *index >= 0 && *index < limit;
+    }
+    if (!IS_NUMBER(value)) {
+        return false;
+    }
+    double number = AS_NUMBER(value);
+    if (!(number >= 0 && number < limit) || number != (int)number) {
+        return false;
+    }
+    *index = (int)number;
+    return true;
+}
+
+/// @brief リストの末尾に値を加える（list.push(value)）
+/// @param arg_count 2
+/// @param args リストと加える値
+/// @return リスト
+static Value push_native(int arg_count, Value* args) {
+    ObjList* list = AS_LIST(args[0]);
+    list_insert(list, list->items.count, args[1]);
+    return args[0];
+}
+
+/// @brief リストの末尾の要素を取り除く（list.pop()）
+/// @param arg_count 1
+/// @param args リスト
+/// @return 取り除いた値
+static Value pop_native(int arg_count, Value* args) {
+    if (AS_LIST(args[0])->items.count == 0) {
+        return native_error("Cannot pop from an empty list.");
+    }
+    return list_pop(AS_LIST(args[0]));
+}
+
+/// @brief リストや浮動小数点数の配列の要素の個数を得る（list.length()）
+/// @param arg_count 1
+/// @param args リストか配列
+/// @return 要素の個数
+static Value length_native(int arg_count, Value* args) {
+    if (IS_FLOAT_ARRAY(args[0])) {
+        return INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+    }
+    return INT_VAL(AS_LIST(args[0])->items.count);
+}
+
+/// @brief リストの指定した位置に値を挿入する（list.insert(index, value)）
+/// @param arg_count 3
+/// @param args リスト，位置（0から要素の個数まで），挿入する値
+/// @return リスト
+static Value insert_native(int arg_count, Value* args) {
+    if (!IS_NUMBER(args[1])) {
+        return native_error("Index must be a number.");
+    }
+    int index;
+    if (!to_index(args[1], AS_LIST(args[0])->items.count + 1, &index)) {
+        return native_error("Index out of range.");
+    }
+    list_insert(AS_LIST(args[0]), index, args[2]);
+    return args[0];
+}
+
+/// @brief 浮動小数点数の配列を作る
+/// @param arg_count 1
+/// @param args 要素の個数（要素は全て0），または数のリスト（要素を写す）
+/// @return 新しい配列
+static Value float_array_native(int arg_count, Value* args) {
+    int count;
+    if (to_index(args[0], INT_MAX, &count)) {
+        return OBJ_VAL(new_float_array(count));
+    }
+    if (IS_NUMBER(args[0])) {
+        return native_error("Float array size must be a non-negative integer.");
+    }
+    if (!IS_LIST(args[0])) {
+        return native_error("Float64Array takes a size or a list of numbers.");
+    }
+
+    ValueArray* items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_NUMBER(items->values[i])) {
+            return native_error("Float array elements must be numbers.");
+        }
+    }
+    // リストは引数としてスタックにあるので，割り当てでGCが走っても残る
+    ObjFloatArray* array = new_float_array(items->count);
+    for (int i = 0; i < array->count; i++) {
+        array->values[i] = AS_NUMBER(items->values[i]);
+    }
+    return OBJ_VAL(array);
+}
+
+/// @brief 引数がレシーバと同じ長さの浮動小数点数の配列かどうかを確かめる
+/// @param array レシーバの配列
+/// @param other 引数
+/// @return エラーのメッセージ．同じ長さの配列ならNULL
+static const char* check_float_array_pair(ObjFloatArray* array, Value other) {
+    if (!IS_FLOAT_ARRAY(other)) {
+        return "Argument must be a float array.";
+    }
+    if (AS_FLOAT_ARRAY(other)->count != array->count) {
+        return "Float arrays must have the same length.";
+    }
+    return NULL;
+}
+
+/// @brief 浮動小数点数の配列の要素の総和を求める（array.sum()）
+/// @param arg_count 1
+/// @param args 配列
+/// @return 総和
+static Value sum_native(int arg_count, Value* args) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    return NUMBER_VAL(float_kernels->sum(array->values, array->count));
+}
+
+/// @brief 2つの浮動小数点数の配列の内積を求める（array.dot(other)）
+/// @param arg_count 2
+/// @param args 同じ長さの2つの配列
+/// @return 内積
+static Value dot_native(int arg_count, Value* args) {
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    const char* error = check_float_array_pair(a, args[1]);
+    if (error != NULL) {
+        return native_error(error);
+    }
+    return NUMBER_VAL(float_kernels->dot(a->values, AS_FLOAT_ARRAY(args[1])->values, a->count));
+}
+
+/// @brief 浮動小数点数の配列の全ての要素に数を掛ける（array.scale(factor)）
+/// @param arg_count 2
+/// @param args 配列と掛ける数
+/// @return 配列
+static Value scale_native(int arg_count, Value* args) {
+    if (!IS_NUMBER(args[1])) {
+        return native_error("Argument must be a number.");
+    }
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    float_kernels->scale(array->values, array->count, AS_NUMBER(args[1]));
+    return args[0];
+}
+
+/// @brief 浮動小数点数の配列の全ての要素に数を足す（array.offset(delta)）
+/// @param arg_count 2
+/// @param args 配列と足す数
+/// @return 配列
+static Value offset_native(int arg_count, Value* args) {
+    if (!IS_NUMBER(args[1])) {
+        return native_error("Argument must be a number.");
+    }
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    float_kernels->offset(array->values, array->count, AS_NUMBER(args[1]));
+    return args[0];
+}
+
+/// @brief 浮動小数点数の配列に，同じ長さの配列を要素ごとに足す（array.add(other)）
+/// @param arg_count 2
+/// @param args 足される配列と足す配列
+/// @return 足される配列
+static Value add_native(int arg_count, Value* args) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    const char* error = check_float_array_pair(array, args[1]);
+    if (error != NULL) {
+        return native_error(error);
+    }
+    float_kernels->add(array->values, AS_FLOAT_ARRAY(args[1])->values, array->count);
+    return args[0];
+}
+
+/// @brief 浮動小数点数の配列の最小の要素を求める（array.min()）
+/// @param arg_count 1
+/// @param args 配列
+/// @return 最小の要素
+static Value min_native(int arg_count, Value* args) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    if (array->count == 0) {
+        return native_error("Float array is empty.");
+    }
+    return NUMBER_VAL(float_kernels->min(array->values, array->count));
+}
+
+/// @brief 浮動小数点数の配列の最大の要素を求める（array.max()）
+/// @param arg_count 1
+/// @param args 配列
+/// @return 最大の要素
+static Value max_native(int arg_count, Value* args) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    if (array->count == 0) {
+        return native_error("Float array is empty.");
+    }
+    return NUMBER_VAL(float_kernels->max(array->values, array->count));
+}
+
+/// @brief マップのメソッドのキーの引数を正規化して，その場に書き戻す
+/// @param args マップ，キー，...
+/// @return キーにできたかどうか
+static bool read_map_key_arg(Value* args) {
+    // 正規化したキー（インターン化した文字列など）は引数に置いてGCから守る
+    return map_key(args[1], &args[1]);
+}
+
+/// @brief マップのキーの値を得る（map.get(key)）
+/// @param arg_count 2
+/// @param args マップとキー
+/// @return 値．キーがなければnil
+static Value get_native(int arg_count, Value* args) {
+    if (!read_map_key_arg(args)) {
+        return native_error("Map key cannot be nil or NaN.");
+    }
+    Value value;
+    if (!map_get(AS_MAP(args[0]), args[1], &value)) {
+        return NIL_VAL;
+    }
+    return value;
+}
+
+/// @brief マップにキーと値を置く（map.set(key, value)）
+/// @param arg_count 3
+/// @param args マップ，キー，値
+/// @return マップ
+static Value set_native(int arg_count, Value* args) {
+    if (!read_map_key_arg(args)) {
+        return native_error("Map key cannot be nil or NaN.");
+    }
+    map_set(AS_MAP(args[0]), args[1], args[2]);
+    return args[0];
+}
+
+/// @brief マップからキーを取り除く（map.delete(key)）
+/// @param arg_count 2
+/// @param args マップとキー
+/// @return キーがあったかどうか
+static Value delete_native(int arg_count, Value* args) {
+    if (!read_map_key_arg(args)) {
+        return native_error("Map key cannot be nil or NaN.");
+    }
+    return BOOL_VAL(map_delete(AS_MAP(args[0]), args[1]));
+}
+
+/// @brief マップにキーがあるかどうかを調べる（map.has(key)）
+/// @param arg_count 2
+/// @param args マップとキー
+/// @return キーがあるかどうか
+static Value has_native(int arg_count, Value* args) {
+    if (!read_map_key_arg(args)) {
+        return native_error("Map key cannot be nil or NaN.");
+    }
+    Value value;
+    return BOOL_VAL(map_get(AS_MAP(args[0]), args[1], &value));
+}
+
+/// @brief マップのキーの個数を得る（map.size()）
+/// @param arg_count 1
+/// @param args マップ
+/// @return キーの個数
+static Value size_native(int arg_count, Value* args) {
+    return INT_VAL(AS_MAP(args[0])->table.count);
+}
+
 /// @brief vm.stackをリセットする
 static void reset_stack() {
     vm.stack_top = vm.stack;
@@ -50,43 +405,178 @@ static void runtime_error(const char* format, ...) {
     reset_stack();
 }
 
-/// @brief ネイティブ関数を定義する
+/// @brief メモリが足りなくなったときにinterpretへ戻る場所
+static jmp_buf out_of_memory_jump;
+
+/// @brief out_of_memory_jumpが有効かどうか（interpretの実行中かどうか）
+static bool out_of_memory_catchable = false;
+
+void raise_out_of_memory() {
+    if (vm.heap_writing) {
+        end_heap_write();
+    }
+
+    if (!out_of_memory_catchable) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(70);
+    }
+    longjmp(out_of_memory_jump, 1);
+}
+
+/// @brief ネイティブ関数を表に定義する
+/// @param table 定義する表
 /// @param name 定義する名前
 /// @param function ネイティブ関数
-static void define_native(const char* name, NativeFn function) {
+/// @param arity 引数の個数．-1なら可変個
+static void define_native_in(Table* table, const char* name, NativeFn function, int arity) {
     // GCに消されないように一旦pushしてpopする
     push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-    push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(new_native(function, arity)));
+    table_set(table, AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
 }
 
+/// @brief ネイティブ関数をグローバルに定義する
+/// @param name 定義する名前
+/// @param function ネイティブ関数
+/// @param arity 引数の個数．-1なら可変個
+static void define_native(const char* name, NativeFn function, int arity) {
+    define_native_in(&vm.globals, name, function, arity);
+}
+
+/// @brief 組み込みの型のメソッドをネイティブ関数として定義する．ネイティブ関数は最初の引数にレシーバを受け取る
+/// @param type レシーバのオブジェクトの種類
+/// @param name メソッド名
+/// @param function ネイティブ関数
+/// @param arity レシーバを除いた引数の個数．-1なら可変個
+static void define_native_method(ObjType type, const char* name, NativeFn function, int arity) {
+    define_native_in(&vm.native_methods[type], name, function, arity);
+}
+
 void init_vm() {
     reset_stack();
-    vm.objects = NULL;
+    init_string_hash();
+    init_float_kernels();
     vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
+    vm.next_gc = GC_INITIAL_HEAP;
+    vm.gc_min_heap = GC_INITIAL_HEAP;
+    vm.next_minor_gc = GC_NURSERY_SIZE;
+
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered = NULL;
+
+    vm.young_string_count = 0;
+    vm.young_string_capacity = 0;
+    vm.young_strings = NULL;
+
+    vm.gc_incremental = false;
+    vm.gc_slice_budget = GC_SLICE_BUDGET;
+    vm.gc_phase = GC_IDLE;
+    vm.next_gc_step = 0;
+    vm.gc_max_pause = 0;
+
+    vm.gc_concurrent = false;
+    vm.gc_threads = 1;
+    vm.gc_compact = false;
+    vm.compact_requested = false;
+    vm.max_heap = 0;
+    vm.gc_growth = GC_HEAP_GROW_FACTOR;
+    vm.gc_cpu_target = GC_CPU_TARGET;
+    pthread_mutex_init(&vm.gc_lock, NULL);
+    vm.heap_writing = false;
+    vm.marker_done = false;
+    vm.satb_count = 0;
+    vm.satb_capacity = 0;
+    vm.satb_buffer = NULL;
 
     vm.gray_count = 0;
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
 
     init_table(&vm.globals);
-    init_table(&vm.strings);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        init_table(&vm.native_methods[i]);
+    }
+    init_string_set(&vm.strings);
+    init_table(&vm.selectors);
+    init_value_array(&vm.selector_names);
 
     vm.init_string = NULL;
     vm.init_string = copy_string("init", 4);
+    vm.init_selector = intern_selector(vm.init_string);
 
     // ネイティブ関数の定義
-    define_native("clock", clock_native);
+    define_native("clock", clock_native, 0);
+    define_native("gcMaxPause", gc_max_pause_native, 0);
+    define_native("gcStat", gc_stat_native, 1);
+    define_native("StringBuilder", string_builder_native, 0);
+    define_native("Float64Array", float_array_native, 1);
+
+    // 組み込みの型のメソッドの定義
+    define_native_method(OBJ_LIST, "push", push_native, 1);
+    define_native_method(OBJ_LIST, "pop", pop_native, 0);
+    define_native_method(OBJ_LIST, "length", length_native, 0);
+    define_native_method(OBJ_LIST, "insert", insert_native, 2);
+    define_native_method(OBJ_FLOAT_ARRAY, "length", length_native, 0);
+    define_native_method(OBJ_FLOAT_ARRAY, "sum", sum_native, 0);
+    define_native_method(OBJ_FLOAT_ARRAY, "dot", dot_native, 1);
+    define_native_method(OBJ_FLOAT_ARRAY, "scale", scale_native, 1);
+    define_native_method(OBJ_FLOAT_ARRAY, "offset", offset_native, 1);
+    define_native_method(OBJ_FLOAT_ARRAY, "add", add_native, 1);
+    define_native_method(OBJ_FLOAT_ARRAY, "min", min_native, 0);
+    define_native_method(OBJ_FLOAT_ARRAY, "max", max_native, 0);
+    define_native_method(OBJ_MAP, "get", get_native, 1);
+    define_native_method(OBJ_MAP, "set", set_native, 2);
+    define_native_method(OBJ_MAP, "delete", delete_native, 1);
+    define_native_method(OBJ_MAP, "has", has_native, 1);
+    define_native_method(OBJ_MAP, "size", size_native, 0);
+    define_native_method(OBJ_STRING_BUILDER, "append", append_native, -1);
+    define_native_method(OBJ_STRING_BUILDER, "toString", to_string_native, 0);
+    define_native_method(OBJ_STRING_BUILDER, "flush", flush_native, 0);
 }
 
 void free_vm() {
+    // 並行してマークしているスレッドを止める
+    finish_gc_cycle();
+
     free_table(&vm.globals);
-    free_table(&vm.strings);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        free_table(&vm.native_methods[i]);
+    }
+    free_string_set(&vm.strings);
+    free_table(&vm.selectors);
+    free_value_array(&vm.selector_names);
     vm.init_string = NULL;
     free_objects();
+    pthread_mutex_destroy(&vm.gc_lock);
+
+    // 全ての配列を解放した後で，それらを切り出していた領域を返す
+    free_pool();
+}
+
+int intern_selector(ObjString* name) {
+    int selector = find_selector(name);
+    if (selector != -1) {
+        return selector;
+    }
+
+    selector = vm.selector_names.count;
+    push(OBJ_VAL(name)); // GC対策
+    table_set(&vm.selectors, name, NUMBER_VAL(selector));
+    write_value_array(&vm.selector_names, OBJ_VAL(name));
+    pop();
+    return selector;
+}
+
+int find_selector(ObjString* name) {
+    Value selector;
+    if (!table_get(&vm.selectors, name, &selector)) {
+        return -1;
+    }
+
+    return (int)AS_NUMBER(selector);
 }
 
 void push(Value value) {
@@ -130,6 +620,29 @@ static bool call(ObjClosure* closure, int arg_count) {
     return true;
 }
 
+/// @brief ネイティブ関数を呼び出し，呼び出した値（メソッドならレシーバ）と引数を結果に置き換える
+/// @param native ネイティブ関数
+/// @param arg_count 引数の個数（レシーバを除く）
+/// @param args ネイティブ関数に渡す引数の先頭（メソッドならレシーバ）．スタックの一番上まで渡す
+/// @return エラーがなければtrue
+static bool call_native(ObjNative* native, int arg_count, Value* args) {
+    if (native->arity != -1 && arg_count != native->arity) {
+        runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+        return false;
+    }
+
+    Value result = native->function((int)(vm.stack_top - args), args);
+    if (native_error_message != NULL) {
+        const char* message = native_error_message;
+        native_error_message = NULL;
+        runtime_error("%s", message);
+        return false;
+    }
+    vm.stack_top -= arg_count + 1;
+    push(result);
+    return true;
+}
+
 /// @brief コールを実行する
 /// @param callee 実行対象
 /// @param arg_count 引数の個数
@@ -148,7 +661,7 @@ static bool call_value(Value callee, int arg_count) {
                 vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(class_));
 
                 Value initializer;
-                if (table_get(&class_->methods, vm.init_string, &initializer)) {
+                if (class_get_method(class_, vm.init_selector, &initializer)) {
                     return call(AS_CLOSURE(initializer), arg_count);
                 } else if (arg_count != 0) {
                     // init()が存在しないとき
@@ -160,13 +673,8 @@ static bool call_value(Value callee, int arg_count) {
             }
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), arg_count);
-            case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(arg_count, vm.stack_top - arg_count);
-                vm.stack_top -= arg_count + 1;
-                push(result);
-                return true;
-            }
+            case OBJ_NATIVE:
+                return call_native(AS_NATIVE(callee), arg_count, vm.stack_top - arg_count);
             default:
                 break;
         }
@@ -177,17 +685,17 @@ static bool call_value(Value callee, int arg_count) {
 
 /// @brief クラスからメソッドの参照と呼び出しを行う
 /// @param class_ メソッドが属するクラス
-/// @param name メソッド名
+/// @param selector メソッド名のセレクタ番号
 /// @param arg_count 引数の個数
 /// @return 成功したかどうか
 static bool invoke_from_class(
     ObjClass* class_,
-    ObjString* name,
+    int selector,
     int arg_count
 ) {
     Value method;
-    if (!table_get(&class_->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
+    if (!class_get_method(class_, selector, &method)) {
+        runtime_error("Undefined property '%s'.", selector_name(selector)->chars);
         return false;
     }
 
@@ -195,38 +703,47 @@ static bool invoke_from_class(
 }
 
 /// @brief メソッドの参照と呼び出しを行う
-/// @param name メソッド名
+/// @param selector メソッド名のセレクタ番号
 /// @param arg_count 引数の個数
 /// @return 成功したかどうか
-static bool invoke(ObjString* name, int arg_count) {
+static bool invoke(int selector, int arg_count) {
     Value receiver = peek(arg_count);
 
     if (!IS_INSTANCE(receiver)) {
-        runtime_error("Only instances have methods.");
-        return false;
+        // 組み込みの型はネイティブ関数のメソッドだけを持つ
+        if (!IS_OBJ(receiver) || vm.native_methods[OBJ_TYPE(receiver)].count == 0) {
+            runtime_error("Only instances have methods.");
+            return false;
+        }
+        Value method;
+        if (!table_get(&vm.native_methods[OBJ_TYPE(receiver)], selector_name(selector), &method)) {
+            runtime_error("Undefined property '%s'.", selector_name(selector)->chars);
+            return false;
+        }
+        return call_native(AS_NATIVE(method), arg_count, vm.stack_top - arg_count - 1);
     }
 
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (table_get(&instance->fields, name, &value)) {
+    if (table_get(&instance->fields, selector_name(selector), &value)) {
         // フィールドを先に探す
         vm.stack_top[-arg_count - 1] = value;
         return call_value(value, arg_count);
     }
     
     // クラスを後に探す
-    return invoke_from_class(instance->class_, name, arg_count);
+    return invoke_from_class(instance->class_, selector, arg_count);
 }
 
 /// @brief メソッドをインスタンスに束縛する
 /// @param class_ クラス
-/// @param name メソッド名
+/// @param selector メソッド名のセレクタ番号
 /// @return メソッドが存在するかどうか
-static bool bind_method(ObjClass* class_, ObjString* name) {
+static bool bind_method(ObjClass* class_, int selector) {
     Value method;
-    if (!table_get(&class_->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
+    if (!class_get_method(class_, selector, &method)) {
+        runtime_error("Undefined property '%s'.", selector_name(selector)->chars);
         return false;
     }
 
@@ -273,6 +790,7 @@ static ObjUpvalue* capture_upvalue(Value* local) {
 /// @brief 上位値をクローズしてヒープに移す
 /// @param last ここで指定されるスロットか，ここより上にある上位値を探して，クローズする
 static void close_upvalues(Value* last) {
+    begin_heap_write();
     while (
         vm.open_upvalues != NULL
         && vm.open_upvalues->location >= last
@@ -280,19 +798,62 @@ static void close_upvalues(Value* last) {
         ObjUpvalue* upvalue = vm.open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        write_barrier((Obj*)upvalue, upvalue->closed);
         vm.open_upvalues = upvalue->next;
     }
+    end_heap_write();
 }
 
 /// @brief メソッドを定義する
-/// @param name メソッドの名前
-static void define_method(ObjString* name) {
+/// @param selector メソッド名のセレクタ番号
+static void define_method(int selector) {
     Value method = peek(0);
     ObjClass* class_ = AS_CLASS(peek(1));
-    table_set(&class_->methods, name, method);
+    class_set_method(class_, selector, method);
     pop();
 }
 
+/// @brief スタックのマップのキーを正規化して，その場に書き戻す
+/// @param distance マップのスタックの上からの位置．キーはその1つ上にある
+/// @param key 正規化したキーを格納する
+/// @return キーにできたかどうか．できなければランタイムエラーを出している
+static bool read_map_key(int distance, Value* key) {
+    Value* slot = vm.stack_top - distance;
+    if (!map_key(*slot, key)) {
+        runtime_error("Map key cannot be nil or NaN.");
+        return false;
+    }
+    // インターン化した文字列をGCから守る
+    *slot = *key;
+    return true;
+}
+
+/// @brief スタックのリストか浮動小数点数の配列と添字を確かめ，添字を位置に変換する
+/// @param distance リストか配列のスタックの上からの位置．添字はその1つ上にある
+/// @param index 変換した位置を格納する
+/// @return 位置に変換できたかどうか．できなければランタイムエラーを出している
+static bool read_index(int distance, int* index) {
+    Value target = peek(distance);
+    int count;
+    if (IS_LIST(target)) {
+        count = AS_LIST(target)->items.count;
+    } else if (IS_FLOAT_ARRAY(target)) {
+        count = AS_FLOAT_ARRAY(target)->count;
+    } else {
+        runtime_error("Only lists, float arrays and maps can be indexed.");
+        return false;
+    }
+    if (!IS_NUMBER(peek(distance - 1))) {
+        runtime_error("Index must be a number.");
+        return false;
+    }
+    if (!to_index(peek(distance - 1), count, index)) {
+        runtime_error("Index out of range.");
+        return false;
+    }
+    return true;
+}
+
 /// @brief 値が偽性かどうかを判定する
 /// @param value 判定される値
 /// @return 値が偽性かどうか
@@ -300,21 +861,58 @@ static bool is_falsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-/// @brief 文字列を連結する
-static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+/// @brief 平らにしたロープは，その文字列を部分として使う
+/// @param text 文字列かロープ
+/// @return 文字列か，平らにしていないロープ
+static inline Obj* rope_part(Obj* text) {
+    if (text->type == OBJ_ROPE && ((ObjRope*)text)->flat != NULL) {
+        return (Obj*)((ObjRope*)text)->flat;
+    }
+    return text;
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+/// @brief スタックの値が短い文字列なら，ロープの部分にできるように文字列オブジェクトに置き換える
+/// @param distance スタックの上からの位置
+static void box_short_operand(int distance) {
+    Value value = peek(distance);
+    if (IS_SHORT_STRING(value)) {
+        char chars[SHORT_STRING_MAX + 1];
+        int length = short_string_chars(value, chars);
+        vm.stack_top[-1 - distance] = OBJ_VAL(copy_runtime_string(chars, length));
+    }
+}
 
-    ObjString* result = take_string(chars, length);
+/// @brief 文字列かロープを連結する．長くなるならロープにして，文字のコピーを平らにするときまで遅らせる
+static void concatenate() {
+    // ロープはROPE_MIN_LENGTH文字以上あるので，短い結果になるのは文字列どうしの連結だけ
+    Value result;
+    if (text_value_length(peek(0)) + text_value_length(peek(1)) < ROPE_MIN_LENGTH) {
+        result = concatenate_strings(peek(1), peek(0));
+    } else {
+        box_short_operand(0);
+        box_short_operand(1);
+        result = OBJ_VAL(new_rope(rope_part(AS_OBJ(peek(1))), rope_part(AS_OBJ(peek(0)))));
+    }
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(result);
+}
+
+/// @brief スタックの値がロープなら，平らにした文字列に置き換える
+/// @param distance スタックの上からの位置
+static void flatten_operand(int distance) {
+    Value value = peek(distance);
+    if (IS_ROPE(value)) {
+        vm.stack_top[-1 - distance] = OBJ_VAL(flatten_rope(AS_ROPE(value)));
+    }
+}
+
+/// @brief 安全点．全てのオブジェクトへの参照がVMのスタックやフレームにある，ループの先頭と関数からの戻りで呼び出す．
+/// コンパクションが要求されていれば，ここで行う
+static inline void safepoint() {
+    if (vm.compact_requested && vm.gc_phase == GC_IDLE) {
+        compact_heap();
+    }
 }
 
 /// @brief 仮想マシンを実行する
@@ -427,7 +1025,12 @@ static InterpretResult run() {
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                begin_heap_write();
+                satb_barrier(*upvalue->location);
+                *upvalue->location = peek(0);
+                write_barrier((Obj*)upvalue, peek(0));
+                end_heap_write();
                 break;
             }
             case OP_GET_PROPERTY: {
@@ -448,7 +1051,12 @@ static InterpretResult run() {
                 }
 
                 // メソッドを後に探す
-                if (!bind_method(instance->class_, name)) {
+                int selector = find_selector(name);
+                if (selector == -1) {
+                    runtime_error("Undefined property '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!bind_method(instance->class_, selector)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
@@ -460,34 +1068,65 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                table_set(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = READ_STRING();
+                begin_heap_write();
+                Value old;
+                if (vm.gc_phase == GC_CONCURRENT_MARK && table_get(&instance->fields, name, &old)) {
+                    satb_barrier(old);
+                }
+                table_set(&instance->fields, name, peek(0));
+                write_barrier((Obj*)instance, OBJ_VAL(name));
+                write_barrier((Obj*)instance, peek(0));
+                end_heap_write();
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
             case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
+                int selector = READ_SHORT();
                 ObjClass* superclass = AS_CLASS(pop());
-                if (!bind_method(superclass, name)) {
+                if (!bind_method(superclass, selector)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_EQUAL: {
+                // ロープは平らにしてから文字列として比べる
+                flatten_operand(0);
+                flatten_operand(1);
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(values_equal(a, b)));
                 break;
             }
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                if (IS_INT_PAIR(peek(0), peek(1))) {
+                    int32_t b = AS_INT(pop());
+                    int32_t a = AS_INT(pop());
+                    push(BOOL_VAL(a > b));
+                } else {
+                    BINARY_OP(BOOL_VAL, >);
+                }
                 break;
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                if (IS_INT_PAIR(peek(0), peek(1))) {
+                    int32_t b = AS_INT(pop());
+                    int32_t a = AS_INT(pop());
+                    push(BOOL_VAL(a < b));
+                } else {
+                    BINARY_OP(BOOL_VAL, <);
+                }
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                // 整数どうしは整数のまま計算し，桁あふれしたらdoubleで計算し直す
+                int32_t sum;
+                if (IS_INT_PAIR(peek(0), peek(1))
+                        && !__builtin_add_overflow(AS_INT(peek(1)), AS_INT(peek(0)), &sum)) {
+                    pop();
+                    pop();
+                    push(INT_VAL(sum));
+                } else if (is_text(peek(0)) && is_text(peek(1))) {
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
@@ -501,15 +1140,49 @@ static InterpretResult run() {
                 break;
             }
                 break;
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+            case OP_SUBTRACT: {
+                int32_t difference;
+                if (IS_INT_PAIR(peek(0), peek(1))
+                        && !__builtin_sub_overflow(AS_INT(peek(1)), AS_INT(peek(0)), &difference)) {
+                    pop();
+                    pop();
+                    push(INT_VAL(difference));
+                } else {
+                    BINARY_OP(NUMBER_VAL, -);
+                }
                 break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
+            }
+            case OP_MULTIPLY: {
+                // 0と負の数の積はdoubleでは-0になるので，doubleで計算する
+                int32_t product;
+                if (IS_INT_PAIR(peek(0), peek(1))
+                        && !__builtin_mul_overflow(AS_INT(peek(1)), AS_INT(peek(0)), &product)
+                        && (product != 0 || (AS_INT(peek(0)) >= 0 && AS_INT(peek(1)) >= 0))) {
+                    pop();
+                    pop();
+                    push(INT_VAL(product));
+                } else {
+                    BINARY_OP(NUMBER_VAL, *);
+                }
                 break;
-            case OP_DIVIDE:
+            }
+            case OP_DIVIDE: {
+                // 割り切れるときだけ整数にする．0を負の数で割ると-0になり，INT32_MIN / -1は桁あふれする
+                if (IS_INT_PAIR(peek(0), peek(1))) {
+                    int32_t b = AS_INT(peek(0));
+                    int32_t a = AS_INT(peek(1));
+                    if (b > 0 || (b < 0 && a != 0 && !(a == INT32_MIN && b == -1))) {
+                        if (a % b == 0) {
+                            pop();
+                            pop();
+                            push(INT_VAL(a / b));
+                            break;
+                        }
+                    }
+                }
                 BINARY_OP(NUMBER_VAL, /);
                 break;
+            }
             case OP_NOT:
                 push(BOOL_VAL(is_falsey(pop())));
                 break;
@@ -518,7 +1191,12 @@ static InterpretResult run() {
                     runtime_error("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                // -0と-INT32_MINは整数で表せない
+                if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 && AS_INT(peek(0)) != INT32_MIN) {
+                    push(INT_VAL(-AS_INT(pop())));
+                } else {
+                    push(NUMBER_VAL(-AS_NUMBER(pop())));
+                }
                 break;
             case OP_PRINT: {
                 print_value(pop());
@@ -540,6 +1218,7 @@ static InterpretResult run() {
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                safepoint();
                 break;
             }
             case OP_CALL: {
@@ -551,9 +1230,9 @@ static InterpretResult run() {
                 break;
             }
             case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+                int selector = READ_SHORT();
                 int arg_count = READ_BYTE();
-                if (!invoke(method, arg_count)) {
+                if (!invoke(selector, arg_count)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
@@ -561,10 +1240,10 @@ static InterpretResult run() {
                 break;
             }
             case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
+                int selector = READ_SHORT();
                 int arg_count = READ_BYTE();
                 ObjClass* superclass = AS_CLASS(pop());
-                if (!invoke_from_class(superclass, method, arg_count)) {
+                if (!invoke_from_class(superclass, selector, arg_count)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frame_count - 1];
@@ -575,6 +1254,7 @@ static InterpretResult run() {
                 ObjClosure* closure = new_closure(function);
                 push(OBJ_VAL(closure));
 
+                begin_heap_write();
                 for (int i = 0; i < closure->upvalue_count; i++) {
                     uint8_t is_local = READ_BYTE();
                     uint8_t index = READ_BYTE();
@@ -584,7 +1264,10 @@ static InterpretResult run() {
                         // 外側の関数から上位値を取り出す
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    // capture_upvalueの割り当てで，クロージャが古い世代になっているかもしれない
+                    write_barrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
                 }
+                end_heap_write();
                 
                 break;
             }
@@ -604,6 +1287,7 @@ static InterpretResult run() {
                 vm.stack_top = frame->slots;
                 push(result);
                 frame = &vm.frames[vm.frame_count - 1];
+                safepoint();
                 break;
             }
             case OP_CLASS:
@@ -617,14 +1301,133 @@ static InterpretResult run() {
                 }
 
                 ObjClass* subclass = AS_CLASS(peek(0));
-                // 表をコピー
-                table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+                // vtableと表をコピー
+                class_inherit(AS_CLASS(superclass), subclass);
                 pop(); // サブクラス
                 break;
             }
             case OP_METHOD:
-                define_method(READ_STRING());
+                define_method(READ_SHORT());
+                break;
+            case OP_BUILD_LIST: {
+                int count = READ_BYTE();
+                // 要素はリストを作り終えるまでスタックに置いておく
+                ObjList* list = new_list(vm.stack_top - count, count);
+                vm.stack_top -= count;
+                push(OBJ_VAL(list));
                 break;
+            }
+            case OP_GET_INDEX: {
+                if (IS_MAP(peek(1))) {
+                    Value key;
+                    if (!read_map_key(1, &key)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    // ないキーはnilになる
+                    Value value;
+                    if (!map_get(AS_MAP(peek(1)), key, &value)) {
+                        value = NIL_VAL;
+                    }
+                    pop();
+                    pop();
+                    push(value);
+                    break;
+                }
+                int index;
+                if (!read_index(1, &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // 浮動小数点数の配列の要素はタグを調べずにそのまま数の値にする
+                Value target = peek(1);
+                Value value = IS_FLOAT_ARRAY(target)
+                    ? NUMBER_VAL(AS_FLOAT_ARRAY(target)->values[index])
+                    : AS_LIST(target)->items.values[index];
+                pop();
+                pop();
+                push(value);
+                break;
+            }
+            case OP_SET_INDEX: {
+                int index;
+                if (IS_MAP(peek(2))) {
+                    Value key;
+                    if (!read_map_key(2, &key)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    map_set(AS_MAP(peek(2)), key, peek(0));
+                } else if (!read_index(2, &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                } else if (IS_FLOAT_ARRAY(peek(2))) {
+                    if (!IS_NUMBER(peek(0))) {
+                        runtime_error("Float array elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    // 参照を持たないのでライトバリアは要らない
+                    AS_FLOAT_ARRAY(peek(2))->values[index] = AS_NUMBER(peek(0));
+                } else {
+                    list_set(AS_LIST(peek(2)), index, peek(0));
+                }
+                Value value = pop();
+                pop();
+                pop();
+                push(value);
+                break;
+            }
+            case OP_BUILD_MAP: {
+                int count = READ_BYTE();
+                // キーと値は作り終えるまでスタックに置いておく
+                push(OBJ_VAL(new_map()));
+                ObjMap* map = AS_MAP(peek(0));
+                Value* entries = vm.stack_top - 1 - 2 * count;
+                for (int i = 0; i < count; i++) {
+                    Value key;
+                    if (!map_key(entries[2 * i], &key)) {
+                        runtime_error("Map key cannot be nil or NaN.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    entries[2 * i] = key;
+                    map_set(map, key, entries[2 * i + 1]);
+                }
+                vm.stack_top -= 2 * count + 1;
+                push(OBJ_VAL(map));
+                break;
+            }
+            case OP_FOR_IN_BEGIN: {
+                Value sequence = peek(0);
+                if (IS_MAP(sequence)) {
+                    // ループの中でマップを書き換えても，始めたときのキーを列挙する
+                    ObjList* keys = map_keys(AS_MAP(sequence));
+                    vm.stack_top[-1] = OBJ_VAL(keys);
+                } else if (!IS_LIST(sequence) && !IS_FLOAT_ARRAY(sequence)) {
+                    runtime_error("Can only iterate over lists, float arrays and maps.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_FOR_IN_NEXT: {
+                uint8_t slot = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                Value sequence = frame->slots[slot];
+                int cursor = AS_INT(frame->slots[slot + 1]);
+                // ループの中でリストが縮むこともあるので，毎回今の長さと比べる
+                if (IS_LIST(sequence)) {
+                    ObjList* list = AS_LIST(sequence);
+                    if (cursor >= list->items.count) {
+                        frame->ip += offset;
+                        break;
+                    }
+                    frame->slots[slot - 1] = list->items.values[cursor];
+                } else {
+                    ObjFloatArray* array = AS_FLOAT_ARRAY(sequence);
+                    if (cursor >= array->count) {
+                        frame->ip += offset;
+                        break;
+                    }
+                    frame->slots[slot - 1] = NUMBER_VAL(array->values[cursor]);
+                }
+                frame->slots[slot + 1] = INT_VAL(cursor + 1);
+                break;
+            }
         }
     }
 
@@ -635,7 +1438,10 @@ static InterpretResult run() {
     #undef BINARY_OP
 }
 
-InterpretResult interpret(const char* source) {
+/// @brief ソースコードをコンパイルして実行する
+/// @param source ソースコード
+/// @return 結果
+static InterpretResult compile_and_run(const char* source) {
     ObjFunction* function = compile(source);
 
     // エラーがあれば実行せずに終了
@@ -651,4 +1457,19 @@ InterpretResult interpret(const char* source) {
     call(closure, 0);
 
     return run();
+}
+
+InterpretResult interpret(const char* source) {
+    if (setjmp(out_of_memory_jump) != 0) {
+        // コンパイルや実行の途中で，ヒープの上限に達したかメモリを得られなかった
+        out_of_memory_catchable = false;
+        abort_compile();
+        runtime_error("Out of memory.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    out_of_memory_catchable = true;
+    InterpretResult result = compile_and_run(source);
+    out_of_memory_catchable = false;
+    return result;
 }
\ No newline at end of file
@@ -5,8 +5,11 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <pthread.h>
+
 #include "object.h"
 #include "chunk.h"
+#include "stringset.h"
 #include "table.h"
 #include "value.h"
 
@@ -21,6 +24,18 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+/// @brief インクリメンタルGCの段階
+typedef enum {
+    /// @brief GCを実行していない
+    GC_IDLE,
+    /// @brief マークを少しずつ進めている
+    GC_MARK,
+    /// @brief 別のスレッドがマークを進めている
+    GC_CONCURRENT_MARK,
+    /// @brief マークを終えて，ページのsweepを少しずつ進めている
+    GC_SWEEP,
+} GcPhase;
+
 /// @brief 仮想マシン
 typedef struct {
     /// @brief コールフレーム
@@ -36,11 +51,23 @@ typedef struct {
     /// @brief グローバルのハッシュ表
     Table globals;
 
+    /// @brief 組み込みの型（リストなど）のメソッド．オブジェクトの種類ごとの，名前からネイティブ関数への表
+    Table native_methods[OBJ_TYPE_COUNT];
+
     /// @brief インターン化された文字列の集合
-    Table strings;
+    StringSet strings;
 
     ObjString* init_string;
 
+    /// @brief メソッド名からセレクタ番号への表
+    Table selectors;
+
+    /// @brief セレクタ番号からメソッド名への配列
+    ValueArray selector_names;
+
+    /// @brief initのセレクタ番号
+    int init_selector;
+
     /// @brief オープンな上位値の配列
     ObjUpvalue* open_upvalues;
 
@@ -50,8 +77,87 @@ typedef struct {
     /// @brief 次のガベージコレクションを実行する，bytes_allocatedの閾値
     size_t next_gc;
 
-    /// @brief GC用の連結リスト
-    Obj* objects;
+    /// @brief 次に若い世代のガベージコレクションを実行する，bytes_allocatedの閾値
+    size_t next_minor_gc;
+
+    /// @brief 記憶集合（若いオブジェクトへの参照を持つ古いオブジェクト）の要素数
+    int remembered_count;
+
+    /// @brief rememberedの容量
+    int remembered_capacity;
+
+    /// @brief 記憶集合
+    Obj** remembered;
+
+    /// @brief young_stringsの要素数
+    int young_string_count;
+
+    /// @brief young_stringsの容量
+    int young_string_capacity;
+
+    /// @brief 前のGCの後にインターン化された文字列．若い世代のGCではこれだけを文字列の表から掃除する
+    ObjString** young_strings;
+
+    /// @brief インクリメンタルGCを行うかどうか
+    bool gc_incremental;
+
+    /// @brief マークを別のスレッドで並行して行うかどうか
+    bool gc_concurrent;
+
+    /// @brief 全世代のGCでマークを並列に行うスレッドの数
+    int gc_threads;
+
+    /// @brief 全世代のGCの後，断片化していたらコンパクションをするかどうか
+    bool gc_compact;
+
+    /// @brief 次の安全点でコンパクションをするかどうか
+    bool compact_requested;
+
+    /// @brief ヒープの上限（バイト）．0なら上限なし
+    size_t max_heap;
+
+    /// @brief 全世代のGCの閾値の下限（バイト）．最初の閾値でもある
+    size_t gc_min_heap;
+
+    /// @brief 全世代のGCで生き残ったバイト数に掛けて，次のGCの閾値とする倍率．
+    /// gc_cpu_targetが0でなければ，全世代のGCのたびにペーサーが決め直す
+    double gc_growth;
+
+    /// @brief 全世代のGCに使うCPU時間の割合の目標．0ならgc_growthを変えない
+    double gc_cpu_target;
+
+    /// @brief インクリメンタルGCの1回あたりの停止時間の予算（ナノ秒）
+    uint64_t gc_slice_budget;
+
+    /// @brief インクリメンタルGCの段階
+    GcPhase gc_phase;
+
+    /// @brief 次にインクリメンタルGCやsweepを進める，bytes_allocatedの閾値
+    size_t next_gc_step;
+
+    /// @brief GCによる停止時間の最大値（ナノ秒）
+    uint64_t gc_max_pause;
+
+    /// @brief 並行マーク中に，マークするスレッドとVMの間でオブジェクトの読み書きを排他する
+    pthread_mutex_t gc_lock;
+
+    /// @brief begin_heap_writeからend_heap_writeまでのあいだかどうか
+    bool heap_writing;
+
+    /// @brief 並行してマークするスレッド
+    pthread_t marker_thread;
+
+    /// @brief マークするスレッドが灰色のオブジェクトをたどり終えたかどうか
+    bool marker_done;
+
+    /// @brief SATBバッファの長さ
+    int satb_count;
+
+    /// @brief SATBバッファの容量
+    int satb_capacity;
+
+    /// @brief 並行マーク中に上書きされた参照を記録するバッファ
+    Obj** satb_buffer;
 
     /// @brief グレイのオブジェクトの数
     int gray_count;
@@ -84,6 +190,27 @@ void free_vm();
 /// @return 結果
 InterpretResult interpret(const char* source);
 
+/// @brief メモリが足りないことを実行時エラーとして報告し，実行中のinterpretから抜ける．
+/// interpretの外では，メッセージを出して終了する
+void raise_out_of_memory();
+
+/// @brief メソッド名をセレクタとして登録し，そのセレクタ番号を返す
+/// @param name メソッド名
+/// @return セレクタ番号（既に登録済みならその番号）
+int intern_selector(ObjString* name);
+
+/// @brief 登録済みのセレクタ番号を探す
+/// @param name メソッド名
+/// @return セレクタ番号または-1（どのクラスにもその名前のメソッドがないとき）
+int find_selector(ObjString* name);
+
+/// @brief セレクタ番号からメソッド名を得る
+/// @param selector セレクタ番号
+/// @return メソッド名
+static inline ObjString* selector_name(int selector) {
+    return (ObjString*)AS_OBJ(vm.selector_names.values[selector]);
+}
+
 /// @brief スタックにValueをプッシュする
 /// @param value プッシュするValue
 void push(Value value);